@@ -0,0 +1,300 @@
+/* -------------------------------------------------------------------------- *
+ *                              OpenMM CPP Forces                             *
+ *                              =================                             *
+ *                                                                            *
+ *  A plugin for distributing platform-agnostic OpenMM Forces                 *
+ *                                                                            *
+ *  Copyright (c) 2024 Charlles Abreu                                         *
+ *  https://github.com/RedesignScience/openmm-cpp-forces                      *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This program measures the time spent in the main operations of CompositeRMSDForce:
+ * creating a Context, evaluating the force, updating parameters in a Context, batch
+ * evaluation, and serialization.  It sweeps over numbers of particles, groups,
+ * threads, and platforms given on the command line, for example
+ *
+ *     BenchmarkCompositeRMSDForce --particles=1000,100000 --groups=1,8 --threads=1,0 \
+ *         --platforms=Reference,CUDA --min-time=0.5 --output=results.json
+ *
+ * The results are written as JSON in the format of Google Benchmark, so that runs on
+ * different commits can be compared with its tools/compare.py script.
+ */
+
+#include "CompositeRMSDForce.h"
+
+#include "OpenMM.h"
+#include "openmm/serialization/XmlSerializer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace OpenMMCPPForces;
+using namespace OpenMM;
+using namespace std;
+
+struct Options {
+    vector<int> particles, groups, threads;
+    vector<string> platforms;
+    double minTime;
+    string output;
+};
+
+struct Result {
+    string name, platform;
+    int particles, groups, threads;
+    long long iterations;
+    double realTime, cpuTime;
+};
+
+template <class T>
+static vector<T> parseList(const string& text) {
+    vector<T> values;
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        T value;
+        stringstream(item) >> value;
+        values.push_back(value);
+    }
+    return values;
+}
+
+static Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    options.particles = {10, 100, 1000, 10000, 100000, 1000000};
+    options.groups = {1, 4};
+    options.threads = {1, 0};
+    options.platforms = {"Reference"};
+    options.minTime = 0.2;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t split = arg.find('=');
+        string name = arg.substr(0, split);
+        string value = (split == string::npos ? "" : arg.substr(split+1));
+        if (name == "--particles")
+            options.particles = parseList<int>(value);
+        else if (name == "--groups")
+            options.groups = parseList<int>(value);
+        else if (name == "--threads")
+            options.threads = parseList<int>(value);
+        else if (name == "--platforms")
+            options.platforms = parseList<string>(value);
+        else if (name == "--min-time")
+            options.minTime = atof(value.c_str());
+        else if (name == "--output")
+            options.output = value;
+        else {
+            cerr << "Usage: " << argv[0] << " [--particles=N,...] [--groups=N,...] [--threads=N,...]" << endl;
+            cerr << "       [--platforms=NAME,...] [--min-time=SECONDS] [--output=FILE]" << endl;
+            exit(name == "--help" ? 0 : 1);
+        }
+    }
+    return options;
+}
+
+/**
+ * Run an operation repeatedly, increasing the number of iterations until they take at
+ * least the minimum time, and report the average wall-clock and CPU times.
+ */
+static Result measure(const string& name, double minTime, const function<void ()>& operation) {
+    Result result;
+    result.name = name;
+    long long iterations = 1;
+    while (true) {
+        clock_t cpuStart = clock();
+        auto start = chrono::steady_clock::now();
+        for (long long i = 0; i < iterations; i++)
+            operation();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        double cpu = (clock()-cpuStart)/(double) CLOCKS_PER_SEC;
+        if (elapsed >= minTime || iterations >= (1LL<<30)) {
+            result.iterations = iterations;
+            result.realTime = 1e6*elapsed/iterations;
+            result.cpuTime = 1e6*cpu/iterations;
+            return result;
+        }
+        double factor = (elapsed > 0.0 ? 1.4*minTime/elapsed : 10.0);
+        iterations = (long long) (iterations*min(10.0, max(2.0, factor)));
+    }
+}
+
+static string escape(const string& text) {
+    string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+static void writeJson(ostream& out, const string& executable, const vector<Result>& results) {
+    time_t now = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    out << "{\n";
+    out << "  \"context\": {\n";
+    out << "    \"date\": \"" << date << "\",\n";
+    out << "    \"executable\": \"" << escape(executable) << "\",\n";
+    out << "    \"num_cpus\": " << thread::hardware_concurrency() << ",\n";
+    out << "    \"openmm_version\": \"" << escape(Platform::getOpenMMVersion()) << "\"\n";
+    out << "  },\n";
+    out << "  \"benchmarks\": [";
+    for (int i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\n";
+        out << "      \"name\": \"" << escape(r.name) << "\",\n";
+        out << "      \"run_name\": \"" << escape(r.name) << "\",\n";
+        out << "      \"run_type\": \"iteration\",\n";
+        out << "      \"repetitions\": 1,\n";
+        out << "      \"repetition_index\": 0,\n";
+        out << "      \"threads\": 1,\n";
+        out << "      \"iterations\": " << r.iterations << ",\n";
+        out << "      \"real_time\": " << r.realTime << ",\n";
+        out << "      \"cpu_time\": " << r.cpuTime << ",\n";
+        out << "      \"time_unit\": \"us\",\n";
+        out << "      \"platform\": \"" << escape(r.platform) << "\",\n";
+        out << "      \"particles\": " << r.particles << ",\n";
+        out << "      \"groups\": " << r.groups << ",\n";
+        out << "      \"force_threads\": " << r.threads << "\n";
+        out << "    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options = parseOptions(argc, argv);
+    Platform::loadPluginsFromDirectory(Platform::getDefaultPluginsDirectory());
+    vector<Result> results;
+    auto record = [&] (Result result, const string& platform, int particles, int groups, int threads) {
+        result.platform = platform;
+        result.particles = particles;
+        result.groups = groups;
+        result.threads = threads;
+        cerr << result.name << ": " << result.realTime << " us (" << result.iterations << " iterations)" << endl;
+        results.push_back(result);
+    };
+    srand(0);
+    for (int numParticles : options.particles) {
+        for (int numGroups : options.groups) {
+            if (numGroups < 1 || numGroups > numParticles)
+                continue;
+
+            // Distribute the particles among the groups in an interleaved way, so that
+            // no group consists of consecutive particles.  Two sets of positions are
+            // alternated, so that every evaluation is actually computed.
+
+            System system;
+            vector<Vec3> referencePos(numParticles), positions1(numParticles), positions2(numParticles);
+            vector<vector<int> > groups(numGroups);
+            for (int i = 0; i < numParticles; i++) {
+                system.addParticle(1.0);
+                referencePos[i] = Vec3(rand(), rand(), rand())*(10.0/RAND_MAX);
+                positions1[i] = referencePos[i] + Vec3(rand(), rand(), rand())*(0.5/RAND_MAX);
+                positions2[i] = referencePos[i] + Vec3(rand(), rand(), rand())*(0.5/RAND_MAX);
+                groups[i%numGroups].push_back(i);
+            }
+            CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+            for (auto& group : groups)
+                force->addGroup(group);
+            system.addForce(force);
+            stringstream suffix;
+            suffix << "/particles:" << numParticles << "/groups:" << numGroups;
+
+            // Serialization does not depend on the platform or the number of threads.
+
+            string xml;
+            record(measure("serialize"+suffix.str(), options.minTime, [&] () {
+                stringstream buffer;
+                XmlSerializer::serialize<CompositeRMSDForce>(force, "Force", buffer);
+                xml = buffer.str();
+            }), "", numParticles, numGroups, 1);
+            record(measure("deserialize"+suffix.str(), options.minTime, [&] () {
+                stringstream buffer(xml);
+                delete XmlSerializer::deserialize<CompositeRMSDForce>(buffer);
+            }), "", numParticles, numGroups, 1);
+
+            for (int numThreads : options.threads) {
+                force->setNumThreads(numThreads);
+                stringstream threadSuffix;
+                threadSuffix << suffix.str() << "/threads:" << numThreads;
+
+                // Batch evaluation runs on the host, independently of any platform.
+
+                int numFrames = max(1, min(100, 10000000/numParticles));
+                vector<double> frames(3LL*numParticles*numFrames), energies(numFrames), gradients(frames.size());
+                for (int f = 0; f < numFrames; f++)
+                    for (int i = 0; i < numParticles; i++)
+                        for (int j = 0; j < 3; j++)
+                            frames[3LL*(numParticles*f+i)+j] = (f%2 == 0 ? positions1 : positions2)[i][j];
+                record(measure("computeBatch/frames:"+to_string(numFrames)+threadSuffix.str(), options.minTime, [&] () {
+                    force->computeBatch(&frames[0], numFrames, numParticles, &energies[0], NULL, &gradients[0]);
+                }), "", numParticles, numGroups, numThreads);
+
+                for (const string& platformName : options.platforms) {
+                    Platform* platform;
+                    try {
+                        platform = &Platform::getPlatformByName(platformName);
+                    }
+                    catch (const OpenMMException& e) {
+                        cerr << "Skipping unavailable platform " << platformName << endl;
+                        continue;
+                    }
+                    string name = "/platform:"+platformName+threadSuffix.str();
+                    record(measure("createContext"+name, options.minTime, [&] () {
+                        VerletIntegrator integrator(0.001);
+                        Context context(system, integrator, *platform);
+                    }), platformName, numParticles, numGroups, numThreads);
+
+                    VerletIntegrator integrator(0.001);
+                    Context context(system, integrator, *platform);
+                    bool first = true;
+                    record(measure("computeForce"+name, options.minTime, [&] () {
+                        context.setPositions(first ? positions1 : positions2);
+                        context.getState(State::Forces);
+                        first = !first;
+                    }), platformName, numParticles, numGroups, numThreads);
+                    record(measure("computeEnergy"+name, options.minTime, [&] () {
+                        context.setPositions(first ? positions1 : positions2);
+                        context.getState(State::Energy);
+                        first = !first;
+                    }), platformName, numParticles, numGroups, numThreads);
+
+                    // Replacing the references leaves the groups unchanged, while replacing
+                    // a group requires it to be validated again.
+
+                    record(measure("updateReferences"+name, options.minTime, [&] () {
+                        force->setReferencePositions(first ? positions1 : referencePos);
+                        force->updateParametersInContext(context);
+                        first = !first;
+                    }), platformName, numParticles, numGroups, numThreads);
+                    force->setReferencePositions(referencePos);
+                    vector<int> smallerGroup(groups[0].begin(), groups[0].end()-(groups[0].size() > 1 ? 1 : 0));
+                    record(measure("updateGroups"+name, options.minTime, [&] () {
+                        force->setGroup(0, first ? smallerGroup : groups[0]);
+                        force->updateParametersInContext(context);
+                        first = !first;
+                    }), platformName, numParticles, numGroups, numThreads);
+                    force->setGroup(0, groups[0]);
+                }
+            }
+        }
+    }
+    if (options.output.empty())
+        writeJson(cout, argv[0], results);
+    else {
+        ofstream out(options.output.c_str());
+        writeJson(out, argv[0], results);
+    }
+    return 0;
+}
@@ -16,6 +16,8 @@
 #include "openmm/Force.h"
 #include "openmm/Vec3.h"
 #include "openmm/internal/AssertionUtilities.h"
+#include <map>
+#include <string>
 #include <vector>
 
 using namespace OpenMM;
@@ -23,6 +25,8 @@ using namespace std;
 
 namespace OpenMMCPPForces {
 
+class CompositeRMSDForceImpl;
+
 /**
  * This is a force whose energy equals a special type of root mean squared deviation
  * (RMSD) between the current coordinates and a reference structure.  It is intended for
@@ -34,6 +38,28 @@ namespace OpenMMCPPForces {
  * structure, then computing the RMSD between the aligned positions and the reference.
  * The computation can optionally be done based on only a subset of the particles
  * in the system.
+ *
+ * Additional reference structures can be added with addReferencePositions().  The
+ * RMSDs with respect to all of them are computed in a single pass over the particles,
+ * and the energy is given by an algebraic expression of these RMSDs, specified with
+ * setEnergyFunction().  The RMSD with respect to reference k is the variable "rmsdk"
+ * in this expression, that is, "rmsd0", "rmsd1", and so on.  By default, the energy
+ * is simply "rmsd0".  The expression may also depend on global parameters, defined
+ * with addGlobalParameter().  Several restraints that share the same groups, such as
+ * the windows of an umbrella sampling simulation, can thus be combined into a single
+ * force, so that positions are gathered and forces are scattered only once.
+ *
+ * The reference positions of each group can also be given separately, with
+ * addGroup(particles, referencePositions) or setGroupReferencePositions().  In this
+ * case, the full reference structure passed to the constructor can be empty, and
+ * memory only scales with the number of particles in groups.
+ *
+ * This force is platform-agnostic: it is always computed on the CPU, even when the
+ * Context uses a GPU platform.  In that case, positions are copied to the host and
+ * forces are copied back to the device at every evaluation.  The GPU platforms run
+ * the host computation in a worker thread while the kernels of other forces execute,
+ * so its cost is hidden as long as it takes less time than them.  For large particle
+ * groups, the host computation can be accelerated with setNumThreads().
  */
 
 class CUSTOM_CPP_FORCES_EXPORT CompositeRMSDForce : public Force {
@@ -44,17 +70,21 @@ public:
      * @param referencePositions  the reference positions to compute the deviation from.
      *                            The length of this vector must equal the number of
      *                            particles in the system, even if not all particles are
-     *                            used in computing the Composite RMSD.
+     *                            used in computing the Composite RMSD.  It can be empty
+     *                            if every group has its own reference positions (see
+     *                            setGroupReferencePositions()).
      */
     explicit CompositeRMSDForce(const vector<Vec3>& referencePositions);
     /**
-     * Get the reference positions to compute the deviation from.
+     * Get the reference positions to compute the deviation from.  This is the same as
+     * getReferencePositions(0).
      */
     const vector<Vec3>& getReferencePositions() const {
-        return referencePositions;
+        return referencePositions[0];
     }
     /**
-     * Set the reference positions to compute the deviation from.
+     * Set the reference positions to compute the deviation from.  This is the same as
+     * setReferencePositions(0, positions).
      *
      * @param positions    the reference positions to compute the deviation from.
      *                     The length of this vector must equal the number of
@@ -62,20 +92,136 @@ public:
      *                     used in computing the composite RMSD.
      */
     void setReferencePositions(const vector<Vec3>& positions);
+    /**
+     * Add a reference structure to compute a deviation from.
+     *
+     * @param positions    the reference positions to compute the deviation from.
+     *                     The length of this vector must equal the number of
+     *                     particles in the system.  It can be empty if every group
+     *                     has its own positions for this reference.
+     *
+     * @return the index of the reference that was added
+     */
+    int addReferencePositions(const vector<Vec3>& positions);
+    /**
+     * Get the number of reference structures, including the one passed to the constructor.
+     */
+    int getNumReferences() const {
+        return referencePositions.size();
+    }
+    /**
+     * Get the positions of a reference structure.
+     *
+     * @param index    the index of the reference whose positions are to be retrieved
+     */
+    const vector<Vec3>& getReferencePositions(int index) const;
+    /**
+     * Set the positions of a reference structure.
+     *
+     * @param index        the index of the reference whose positions are to be set
+     * @param positions    the reference positions to compute the deviation from.
+     *                     The length of this vector must equal the number of
+     *                     particles in the system.
+     */
+    void setReferencePositions(int index, const vector<Vec3>& positions);
+    /**
+     * Get the algebraic expression that gives the energy as a function of the RMSDs
+     * with respect to the reference structures.
+     */
+    const string& getEnergyFunction() const {
+        return energyFunction;
+    }
+    /**
+     * Set the algebraic expression that gives the energy as a function of the RMSDs
+     * with respect to the reference structures.  The RMSD with respect to reference k
+     * is the variable "rmsdk".  The default is "rmsd0".
+     *
+     * @param energy    the energy expression
+     */
+    void setEnergyFunction(const string& energy) {
+        energyFunction = energy;
+    }
+    /**
+     * Get the number of global parameters that the energy depends on.
+     */
+    int getNumGlobalParameters() const {
+        return globalParameters.size();
+    }
+    /**
+     * Add a new global parameter that the energy may depend on.  The default value
+     * provided here is used when the Context is created.
+     *
+     * @param name             the name of the parameter
+     * @param defaultValue     the default value of the parameter
+     *
+     * @return the index of the parameter that was added
+     */
+    int addGlobalParameter(const string& name, double defaultValue);
+    /**
+     * Get the name of a global parameter.
+     *
+     * @param index     the index of the parameter for which to get the name
+     */
+    const string& getGlobalParameterName(int index) const;
+    /**
+     * Set the name of a global parameter.
+     *
+     * @param index          the index of the parameter for which to set the name
+     * @param name           the name of the parameter
+     */
+    void setGlobalParameterName(int index, const string& name);
+    /**
+     * Get the default value of a global parameter.
+     *
+     * @param index     the index of the parameter for which to get the default value
+     */
+    double getGlobalParameterDefaultValue(int index) const;
+    /**
+     * Set the default value of a global parameter.
+     *
+     * @param index          the index of the parameter for which to set the default value
+     * @param defaultValue   the default value of the parameter
+     */
+    void setGlobalParameterDefaultValue(int index, double defaultValue);
     /**
      * Add a group of particles to be included in the composite RMSD calculation.
      *
-     * @param particles    the indices of the particles to include
+     * @param particles    the indices of the particles to include.  An empty vector
+     *                     means all particles in the system.
      *
      * @return the index of the group that was added
      */
     int addGroup(const vector<int>& particles);
+    /**
+     * Add a group of particles along with their positions in the first reference
+     * structure.  This is the same as calling addGroup(particles) followed by
+     * setGroupReferencePositions(index, 0, referencePositions).
+     *
+     * @param particles             the indices of the particles to include
+     * @param referencePositions    the positions of these particles in the first
+     *                              reference structure, in the same order
+     *
+     * @return the index of the group that was added
+     */
+    int addGroup(const vector<int>& particles, const vector<Vec3>& referencePositions);
+    /**
+     * Add a group formed by a range of consecutive particles.  This avoids storing
+     * the index of every particle in large groups.
+     *
+     * @param first    the index of the first particle in the group
+     * @param last     the index one past the last particle in the group
+     *
+     * @return the index of the group that was added
+     */
+    int addGroupRange(int first, int last);
     /**
      * Get the number of particle groups included in the composite RMSD calculation.
      */
     int getNumGroups() const;
     /**
-     * Get the particles of a group included in the composite RMSD calculation.
+     * Get the particles of a group included in the composite RMSD calculation.  If the
+     * group is a range of particles, the returned vector is empty and getGroupRange()
+     * must be used instead.
      *
      * @param index    the index of the group whose particles are to be retrieved
      */
@@ -85,13 +231,267 @@ public:
      */
     void setGroup(int index, const vector<int>& particles);
     /**
-     * Update the reference positions and particle groups in a Context to match those stored
+     * Get whether a group is a range of consecutive particles.
+     *
+     * @param index    the index of the group
+     */
+    bool getGroupIsRange(int index) const;
+    /**
+     * Get the range of particles of a group added with addGroupRange() or modified with
+     * setGroupRange().
+     *
+     * @param index         the index of the group whose range is to be retrieved
+     * @param[out] first    the index of the first particle in the group
+     * @param[out] last     the index one past the last particle in the group
+     */
+    void getGroupRange(int index, int& first, int& last) const;
+    /**
+     * Set a group to be a range of consecutive particles.
+     *
+     * @param index    the index of the group to modify
+     * @param first    the index of the first particle in the group
+     * @param last     the index one past the last particle in the group
+     */
+    void setGroupRange(int index, int first, int last);
+    /**
+     * Get the positions of the particles of a group in a reference structure, if they
+     * were given specifically for this group.  Otherwise, the returned vector is empty.
+     *
+     * @param group        the index of the group
+     * @param reference    the index of the reference structure
+     */
+    const vector<Vec3>& getGroupReferencePositions(int group, int reference) const;
+    /**
+     * Set the positions of the particles of a group in a reference structure.  These
+     * replace the positions of the same particles in the full reference structure, so
+     * that reference positions only need to be stored for particles in groups.
+     *
+     * @param group        the index of the group
+     * @param reference    the index of the reference structure
+     * @param positions    the reference positions of the particles in the group, in the
+     *                     same order as the particles, or an empty vector to use the full
+     *                     reference structure.  For a range of particles, or for a group
+     *                     containing all particles, they are in order of increasing index.
+     */
+    void setGroupReferencePositions(int group, int reference, const vector<Vec3>& positions);
+    /**
+     * Update the reference positions, particle groups, and energy function in a Context to match those stored
      * in this Force object.  This method provides an efficient way to update these parameters
      * in an existing Context without needing to reinitialize it.  Simply call setReferencePositions()
      * and setGroup() to modify this object's parameters, then call updateParametersInContext()
-     * to copy them over to the Context.
+     * to copy them over to the Context.  If the groups have not changed, they are not
+     * validated again, which makes replacing only the reference positions cheap.  If the
+     * new parameters are invalid, an exception is thrown and the Context keeps using the
+     * previous ones.
      */
     void updateParametersInContext(Context& context);
+    /**
+     * Get the RMSD of each group with respect to a reference structure in a Context.
+     * All groups are first aligned with the same optimal rotation used to compute the
+     * composite RMSD, so these values show which groups deviate the most.  This force
+     * alone is evaluated, without computing the other forces in the Context, if the
+     * positions or global parameters have changed since the last evaluation.
+     *
+     * @param context      the Context for which to get the values
+     * @param rmsds        on exit, the RMSD of each group
+     * @param reference    the index of the reference structure
+     */
+    void getGroupRMSDs(Context& context, vector<double>& rmsds, int reference=0);
+    /**
+     * Get the optimal rotation with respect to a reference structure in a Context,
+     * as a unit quaternion (w, x, y, z) with a non-negative first component.  The
+     * corresponding rotation matrix aligns the centered positions of all groups to the
+     * centered reference.  As in getGroupRMSDs(), this force alone is evaluated if
+     * the positions or global parameters have changed since the last evaluation.
+     *
+     * @param context      the Context for which to get the rotation
+     * @param quaternion   on exit, the four components of the quaternion
+     * @param reference    the index of the reference structure
+     */
+    void getOptimalRotation(Context& context, vector<double>& quaternion, int reference=0);
+    /**
+     * Compute the product of the Hessian of the energy of this force, at the current
+     * positions of a Context, with a direction in configuration space.  The product is
+     * found analytically from the perturbation of the optimal rotations, at a cost
+     * comparable to that of one force evaluation.  This is useful for second-order
+     * minimizers and for normal mode analysis under composite RMSD restraints.  This
+     * force alone is evaluated, without computing the other forces in the Context, if
+     * the positions or global parameters have changed since the last evaluation.  RMSDs
+     * that are zero, for which the Hessian is undefined, do not contribute to the
+     * product, and neither do the contributions of nearly degenerate eigenvalues of the
+     * alignment problem.
+     *
+     * @param context      the Context whose positions to compute the Hessian at
+     * @param direction    the direction to multiply by, for every particle in the System
+     * @param product      on exit, the product of the Hessian with the direction, for
+     *                     every particle in the System, in kJ/mol/nm^2 times the units
+     *                     of the direction
+     */
+    void computeHessianTimesVector(Context& context, const vector<Vec3>& direction, vector<Vec3>& product);
+    /**
+     * Compute the energy of this force for a batch of frames, such as those of a stored
+     * trajectory, without creating a Context.  The frames are evaluated with the same
+     * code used to compute the force in a Context, and global parameters take their
+     * default values.  Frames are split among the threads set with setNumThreads(), and
+     * the results do not depend on the number of threads.  Warm starts are not used.
+     *
+     * @param frames        the coordinates of all particles in every frame, in nm, as
+     *                      numFrames consecutive blocks of 3*numParticles values
+     *                      (x, y, and z of each particle).  They are read in place, so
+     *                      this may point to a memory-mapped file.
+     * @param numFrames     the number of frames
+     * @param numParticles  the number of particles in each frame, which corresponds
+     *                      to the number of particles in the System
+     * @param energies      on exit, the energy in each frame (numFrames values).  With
+     *                      the default energy function, this is the composite RMSD.
+     * @param rmsds         if not NULL, on exit, the RMSD with respect to each reference
+     *                      in each frame, as numFrames consecutive blocks of
+     *                      getNumReferences() values
+     * @param gradients     if not NULL, on exit, the gradient of the energy with respect
+     *                      to the coordinates in each frame, in the same layout as frames
+     */
+    void computeBatch(const double* frames, int numFrames, int numParticles, double* energies,
+                      double* rmsds=NULL, double* gradients=NULL) const;
+    /**
+     * Get the number of threads used to compute this force.  A value of 0 means that
+     * as many threads as there are processors are used.
+     */
+    int getNumThreads() const {
+        return numThreads;
+    }
+    /**
+     * Set the number of threads used to compute this force.  By default, the force
+     * is computed in a single thread.  Using multiple threads is only worthwhile for
+     * large particle groups.  The results do not depend on the number of threads.  A
+     * change only takes effect in existing Contexts after updateParametersInContext()
+     * is called.
+     *
+     * @param threads    the number of threads to use, or 0 to use as many threads as
+     *                   there are processors
+     */
+    void setNumThreads(int threads);
+    /**
+     * Get whether the number of threads is chosen automatically when a Context is
+     * created.
+     */
+    bool getUseAutotuning() const {
+        return useAutotuning;
+    }
+    /**
+     * Set whether the number of threads is chosen automatically when a Context is
+     * created.  If enabled, the passes over the particles are timed on the actual
+     * groups with 1, 2, 4, ... threads, up to the number set with setNumThreads(), and
+     * the fastest choice is kept.  This takes a few milliseconds per candidate and is
+     * repeated only when the groups or the settings that affect the timings change.
+     * The number of threads chosen is reported by getProfile().  This is disabled by
+     * default, in which case exactly the number of threads set with setNumThreads() is
+     * used.  A change only takes effect in existing Contexts after
+     * updateParametersInContext() is called.
+     *
+     * @param use    whether to choose the number of threads automatically
+     */
+    void setUseAutotuning(bool use) {
+        useAutotuning = use;
+    }
+    /**
+     * Get whether the optimal rotation is searched for starting from the one found in
+     * the previous evaluation.
+     */
+    bool getUseWarmStart() const {
+        return useWarmStart;
+    }
+    /**
+     * Set whether the optimal rotation is searched for starting from the one found in
+     * the previous evaluation.  This saves a few iterations when the positions change
+     * little between evaluations, as in molecular dynamics.  If the warm start fails to
+     * converge, the search is restarted from scratch.  This is disabled by default.
+     * A change only takes effect in existing Contexts after updateParametersInContext()
+     * is called.
+     *
+     * @param use    whether to use warm starts
+     */
+    void setUseWarmStart(bool use) {
+        useWarmStart = use;
+    }
+    /**
+     * Get the relative tolerance for convergence of the largest eigenvalue of the
+     * quaternion key matrix, which determines the optimal rotation.
+     */
+    double getAlignmentTolerance() const {
+        return alignmentTolerance;
+    }
+    /**
+     * Set the relative tolerance for convergence of the largest eigenvalue of the
+     * quaternion key matrix, which determines the optimal rotation.  The default value
+     * is 1e-14.  A change only takes effect in existing Contexts after
+     * updateParametersInContext() is called.
+     *
+     * @param tolerance    the relative tolerance, which must be positive
+     */
+    void setAlignmentTolerance(double tolerance);
+    /**
+     * Get whether positions and forces are stored and processed in single precision,
+     * with sums accumulated in double precision.
+     */
+    bool getUseMixedPrecision() const {
+        return useMixedPrecision;
+    }
+    /**
+     * Set whether positions and forces are stored and processed in single precision,
+     * with the correlation matrices and sums of squares accumulated in double precision.
+     * This halves the memory traffic for large groups, at the cost of relative errors
+     * of about 1e-6 in the RMSD and 1e-5 in the forces.  This is disabled by default.  A change only
+     * takes effect in existing Contexts after updateParametersInContext() is called.
+     *
+     * @param use    whether to use mixed precision
+     */
+    void setUseMixedPrecision(bool use) {
+        useMixedPrecision = use;
+    }
+    /**
+     * Get whether the time spent in each phase of the computation and the number of
+     * certain events are recorded in every Context.
+     */
+    bool getUseProfiling() const {
+        return useProfiling;
+    }
+    /**
+     * Set whether the time spent in each phase of the computation and the number of
+     * certain events are recorded in every Context, to be retrieved with getProfile().
+     * The overhead is a few clock readings per evaluation.  This is disabled by
+     * default.  A change only takes effect in existing Contexts after
+     * updateParametersInContext() is called.
+     *
+     * @param use    whether to record the profile
+     */
+    void setUseProfiling(bool use) {
+        useProfiling = use;
+    }
+    /**
+     * Get the profile recorded in a Context since profiling was enabled or the profile
+     * was last reset.  The entries are the numbers of evaluations ("evaluations"),
+     * of evaluations that reused the previous result because the positions had not
+     * changed ("cacheHits"), of evaluations that skipped the forces ("energyOnly"),
+     * of RMSDs with respect to a reference that were zero, for which no rotation is
+     * computed ("zeroRMSDs"), of warm starts that did not converge ("warmStartFallbacks"),
+     * and of eigenvalue problems that were solved by full diagonalization
+     * ("solverFallbacks").  The remaining entries are the total times, in seconds,
+     * spent gathering and adding up positions ("gatherTime"), accumulating correlation
+     * matrices ("correlationTime"), solving for the RMSDs and evaluating the energy
+     * function ("eigenTime"), and computing and scattering the forces ("forceTime").
+     * The last entry is the number of threads in use ("numThreads"), which is reported
+     * even if profiling is disabled.
+     *
+     * @param context    the Context for which to get the profile
+     * @param profile    on exit, the value of each entry of the profile
+     */
+    void getProfile(Context& context, map<string, double>& profile);
+    /**
+     * Reset all entries of the profile recorded in a Context to zero.
+     *
+     * @param context    the Context whose profile is to be reset
+     */
+    void resetProfile(Context& context);
     /**
      * Returns whether or not this force makes use of periodic boundary
      * conditions.
@@ -104,8 +504,41 @@ public:
 protected:
     ForceImpl* createImpl() const;
 private:
-    vector<Vec3> referencePositions;
+    friend class CompositeRMSDForceImpl;
+    class GlobalParameterInfo;
+    /**
+     * Get a number that differs from all others handed out in the process, used to
+     * identify the groups and the reference positions of this force.  Copies of the
+     * force keep the revisions of the original until they are modified.
+     */
+    static long long newRevision();
+    long long groupsRevision, referencesRevision;
+    vector<vector<Vec3>> referencePositions;
     vector<vector<int>> groups;
+    vector<pair<int, int>> groupRanges;
+    vector<vector<vector<Vec3>>> groupReferencePositions;
+    string energyFunction;
+    vector<GlobalParameterInfo> globalParameters;
+    int numThreads;
+    bool useWarmStart;
+    double alignmentTolerance;
+    bool useMixedPrecision;
+    bool useProfiling;
+    bool useAutotuning;
+};
+
+/**
+ * This is an internal class used to record information about a global parameter.
+ * @private
+ */
+class CompositeRMSDForce::GlobalParameterInfo {
+public:
+    string name;
+    double defaultValue;
+    GlobalParameterInfo() {
+    }
+    GlobalParameterInfo(const string& name, double defaultValue) : name(name), defaultValue(defaultValue) {
+    }
 };
 
 } // namespace OpenMMCPPForces
@@ -15,6 +15,17 @@
 
 #include "openmm/internal/CustomCPPForceImpl.h"
 #include "openmm/internal/ContextImpl.h"
+#include "openmm/internal/ThreadPool.h"
+#include "lepton/CompiledExpression.h"
+#include "lepton/ParsedExpression.h"
+#include "jama/tnt_array1d.h"
+#include "jama/tnt_array2d.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 using namespace OpenMM;
@@ -29,20 +40,172 @@ namespace OpenMMCPPForces {
 class CompositeRMSDForceImpl : public CustomCPPForceImpl {
 public:
     CompositeRMSDForceImpl(const CompositeRMSDForce& owner) :
-      CustomCPPForceImpl(owner), owner(owner), resetForces(true) {}
+      CustomCPPForceImpl(owner), owner(owner), resetForces(true), forcesRequested(true), cacheValid(false), serial(false), profiling(false), numThreads(1) {}
     void initialize(ContextImpl& context);
+    double calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups);
     double computeForce(ContextImpl& context, const vector<Vec3>& positions, vector<Vec3>& forces);
     const CompositeRMSDForce& getOwner() const {
         return owner;
     }
     void updateParametersInContext(ContextImpl& context);
+    map<string, double> getDefaultParameters();
+    /**
+     * Compute the energy of this force alone at the current positions and global
+     * parameters of a Context, so that the results of the last evaluation describe them.
+     * Nothing is recomputed if neither has changed since the last evaluation.
+     */
+    void evaluateInContext(ContextImpl& context);
+    /**
+     * Get the unit quaternion of the optimal rotation with respect to a reference,
+     * as found in the last evaluation.
+     */
+    void getLastQuaternion(int reference, double q[4]) const;
+    /**
+     * Get the matrix of the optimal rotation with respect to a reference, as found in
+     * the last evaluation.  It rotates the centered positions onto the reference.
+     */
+    void getLastRotation(int reference, double U[3][3]) const;
+    /**
+     * Get the RMSD of each group with respect to a reference after the optimal
+     * rotation found in the last evaluation.
+     */
+    void getLastGroupRMSDs(int reference, vector<double>& rmsds) const;
+    /**
+     * Evaluate a force for a batch of frames outside of a Context, as described in
+     * CompositeRMSDForce::computeBatch().
+     */
+    static void computeBatch(const CompositeRMSDForce& force, const double* frames, int numFrames, int numParticles,
+                             double* energies, double* rmsds, double* gradients);
+    /**
+     * Compute the product of the Hessian of the energy at the positions of the last
+     * evaluation with a direction, as described in
+     * CompositeRMSDForce::computeHessianTimesVector().
+     */
+    void computeHessianTimesVector(const vector<Vec3>& direction, vector<Vec3>& product);
+    /**
+     * Get the profile recorded since profiling was enabled or the profile was last reset.
+     */
+    void getProfile(map<string, double>& values) const;
+    /**
+     * Reset all entries of the profile to zero.
+     */
+    void resetProfile();
 private:
+    /**
+     * The event counts and the times, in seconds, recorded while profiling is enabled.
+     */
+    struct Profile {
+        long long evaluations, cacheHits, energyOnly, zeroRMSDs, warmStartFallbacks, solverFallbacks;
+        double gatherTime, correlationTime, eigenTime, forceTime;
+        Profile() : evaluations(0), cacheHits(0), energyOnly(0), zeroRMSDs(0), warmStartFallbacks(0), solverFallbacks(0),
+                gatherTime(0), correlationTime(0), eigenTime(0), forceTime(0) {}
+    };
+    /**
+     * The scratch space of Hessian-vector products.  It is kept between calls, so that
+     * repeated products with the same force do not allocate it again.
+     */
+    struct HessianWorkspace {
+        vector<double> sums, groupMeans, totals, rotations, rotationDerivatives, projections;
+        vector<double> secondDerivatives, matrices;
+        vector<int> contributing;
+        TNT::Array2D<double> keyMatrix, eigenvectors;
+        TNT::Array1D<double> eigenvalues;
+        HessianWorkspace() : keyMatrix(4, 4) {}
+    };
+    /**
+     * The layout of the particles in groups.  It does not change between evaluations
+     * and is shared by all Contexts whose forces have the same revision of the groups.
+     */
+    struct ParticleLayout {
+        int systemSize;
+        long long groupsRevision;
+        vector<int> particles, particleRanks, groupOffsets;
+        vector<int> chunkOffsets, chunkGroups, chunkFirstParticles;
+    };
+    /**
+     * The centered reference positions in the working precision.  They do not change
+     * between evaluations and are shared by all Contexts whose forces have the same
+     * layout and revision of the references.
+     */
+    template <class REAL>
+    struct ReferenceArrays {
+        shared_ptr<const ParticleLayout> layout;
+        vector<REAL> refX, refY, refZ;
+        vector<double> sumRefPosSq, groupSumRefPosSq;
+    };
+    template <class REAL>
+    struct ParticleArrays {
+        shared_ptr<const ReferenceArrays<REAL> > references;
+        vector<REAL> posX, posY, posZ;
+        vector<REAL> forceX, forceY, forceZ;
+    };
     void updateParameters(int systemSize);
+    int findVariable(const string& name, const vector<string>& parameterNames, int numReferences) const;
+    bool layoutMatches(const ParticleLayout& layout, int systemSize) const;
+    void createLayout(ParticleLayout& layout, int systemSize) const;
+    pair<int, int> getGroupRange(int index) const;
+    void updateGlobalValues(ContextImpl& context);
+    double evaluate(const Vec3* positions, vector<Vec3>& forces);
+    void setThreads(int count);
+    void autotuneThreads(int systemSize, int maxThreads);
+    void execute(int count, const function<void (int, int, int)>& task);
+    template <class REAL>
+    ParticleArrays<REAL>& getArrays();
+    template <class REAL>
+    void initializeArrays();
+    template <class REAL>
+    void selectKernels();
+    template <class REAL>
+    bool sumPositions(const Vec3* positions, int first, int last);
+    template <class REAL>
+    void accumulateCorrelation(int first, int last);
+    template <class REAL>
+    void computeForces(int first, int last, vector<Vec3>& forces);
+    template <class REAL>
+    void multiplyByHessian(const vector<Vec3>& direction, vector<Vec3>& product);
+    void computeSecondDerivatives(vector<double>& secondDerivatives);
     const CompositeRMSDForce& owner;
-    vector<vector<int>> groups;
-    vector<Vec3> referencePos;
-    double sumRefPosSq;
-    bool resetForces;
+    shared_ptr<const ParticleLayout> layout;
+    ParticleArrays<double> doubleArrays;
+    ParticleArrays<float> floatArrays;
+    bool mixedPrecision;
+    vector<double> sumRefPosSq, groupSumRefPosSq;
+    vector<double> centers, groupSums;
+    double sumPosSq;
+    vector<double> correlations, keyMatrices, maxEigenvalues, rmsds, energyDerivatives, rotations;
+    vector<char> eigenvalueConverged;
+    vector<int> activeReferences;
+    double positionScale;
+    Lepton::ParsedExpression parsedEnergy;
+    Lepton::CompiledExpression energyExpression;
+    vector<Lepton::CompiledExpression> derivativeExpressions;
+    vector<int> derivativeReferences;
+    vector<pair<double*, int> > variableBindings;
+    vector<Lepton::CompiledExpression> secondDerivativeExpressions;
+    vector<pair<int, int> > secondDerivativeReferences;
+    vector<pair<double*, int> > secondDerivativeBindings;
+    bool secondDerivativesReady;
+    HessianWorkspace hessian;
+    vector<string> globalParameterNames;
+    vector<double> globalValues;
+    vector<double> chunkSums;
+    vector<char> threadChanged;
+    vector<int> staleParticles;
+    vector<Vec3> contextPositions;
+    bool resetForces, forcesRequested, cacheValid, cacheHasForces, serial;
+    double cachedEnergy;
+    bool useWarmStart;
+    double tolerance;
+    vector<double> lastQuaternions;
+    vector<char> hasLastQuaternion;
+    bool profiling;
+    Profile profile;
+    bool (CompositeRMSDForceImpl::*sumPositionsKernel)(const Vec3* positions, int first, int last);
+    void (CompositeRMSDForceImpl::*accumulateCorrelationKernel)(int first, int last);
+    void (CompositeRMSDForceImpl::*computeForcesKernel)(int first, int last, vector<Vec3>& forces);
+    unique_ptr<ThreadPool> threads;
+    int numThreads;
+    tuple<shared_ptr<const ParticleLayout>, int, int, bool> tunedFor;
 };
 
 } // namespace OpenMMCPPForces
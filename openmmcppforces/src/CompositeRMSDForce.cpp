@@ -12,21 +12,69 @@
 #include "internal/CompositeRMSDForceImpl.h"
 
 #include "openmm/internal/AssertionUtilities.h"
+#include <atomic>
 
 using namespace OpenMMCPPForces;
 using namespace OpenMM;
 using namespace std;
 
 CompositeRMSDForce::CompositeRMSDForce(const vector<Vec3>& referencePositions) :
-        referencePositions(referencePositions) {
+        referencePositions(1, referencePositions), energyFunction("rmsd0"), numThreads(1),
+        useWarmStart(false), alignmentTolerance(1e-14), useMixedPrecision(false), useProfiling(false), useAutotuning(false) {
+    groupsRevision = newRevision();
+    referencesRevision = newRevision();
+}
+
+long long CompositeRMSDForce::newRevision() {
+    static atomic<long long> lastRevision(0);
+    return ++lastRevision;
 }
 
 void CompositeRMSDForce::setReferencePositions(const std::vector<Vec3>& positions) {
-    referencePositions = positions;
+    referencePositions[0] = positions;
+    referencesRevision = newRevision();
+}
+
+int CompositeRMSDForce::addReferencePositions(const vector<Vec3>& positions) {
+    referencePositions.push_back(positions);
+    for (auto& group : groupReferencePositions)
+        group.push_back(vector<Vec3>());
+    referencesRevision = newRevision();
+    return referencePositions.size()-1;
+}
+
+const vector<Vec3>& CompositeRMSDForce::getReferencePositions(int index) const {
+    ASSERT_VALID_INDEX(index, referencePositions);
+    return referencePositions[index];
+}
+
+void CompositeRMSDForce::setReferencePositions(int index, const std::vector<Vec3>& positions) {
+    ASSERT_VALID_INDEX(index, referencePositions);
+    referencePositions[index] = positions;
+    referencesRevision = newRevision();
 }
 
 int CompositeRMSDForce::addGroup(const vector<int>& particles) {
     groups.push_back(particles);
+    groupRanges.push_back(make_pair(0, 0));
+    groupReferencePositions.push_back(vector<vector<Vec3>>(referencePositions.size()));
+    groupsRevision = newRevision();
+    return groups.size()-1;
+}
+
+int CompositeRMSDForce::addGroup(const vector<int>& particles, const vector<Vec3>& referencePositions) {
+    int index = addGroup(particles);
+    setGroupReferencePositions(index, 0, referencePositions);
+    return index;
+}
+
+int CompositeRMSDForce::addGroupRange(int first, int last) {
+    if (first < 0 || last <= first)
+        throw OpenMMException("CompositeRMSDForce: Illegal particle range");
+    groups.push_back(vector<int>());
+    groupRanges.push_back(make_pair(first, last));
+    groupReferencePositions.push_back(vector<vector<Vec3>>(referencePositions.size()));
+    groupsRevision = newRevision();
     return groups.size()-1;
 }
 
@@ -42,12 +90,120 @@ const vector<int>& CompositeRMSDForce::getGroup(int index) const {
 void CompositeRMSDForce::setGroup(int index, const std::vector<int>& particles) {
     ASSERT_VALID_INDEX(index, groups);
     groups[index] = particles;
+    groupRanges[index] = make_pair(0, 0);
+    groupsRevision = newRevision();
+}
+
+bool CompositeRMSDForce::getGroupIsRange(int index) const {
+    ASSERT_VALID_INDEX(index, groups);
+    return groupRanges[index].second > 0;
+}
+
+void CompositeRMSDForce::getGroupRange(int index, int& first, int& last) const {
+    ASSERT_VALID_INDEX(index, groups);
+    if (!getGroupIsRange(index))
+        throw OpenMMException("CompositeRMSDForce: Group is not a range of particles");
+    first = groupRanges[index].first;
+    last = groupRanges[index].second;
+}
+
+void CompositeRMSDForce::setGroupRange(int index, int first, int last) {
+    ASSERT_VALID_INDEX(index, groups);
+    if (first < 0 || last <= first)
+        throw OpenMMException("CompositeRMSDForce: Illegal particle range");
+    groups[index] = vector<int>();
+    groupRanges[index] = make_pair(first, last);
+    groupsRevision = newRevision();
+}
+
+const vector<Vec3>& CompositeRMSDForce::getGroupReferencePositions(int group, int reference) const {
+    ASSERT_VALID_INDEX(group, groups);
+    ASSERT_VALID_INDEX(reference, referencePositions);
+    return groupReferencePositions[group][reference];
+}
+
+void CompositeRMSDForce::setGroupReferencePositions(int group, int reference, const vector<Vec3>& positions) {
+    ASSERT_VALID_INDEX(group, groups);
+    ASSERT_VALID_INDEX(reference, referencePositions);
+    groupReferencePositions[group][reference] = positions;
+    referencesRevision = newRevision();
+}
+
+int CompositeRMSDForce::addGlobalParameter(const string& name, double defaultValue) {
+    globalParameters.push_back(GlobalParameterInfo(name, defaultValue));
+    return globalParameters.size()-1;
+}
+
+const string& CompositeRMSDForce::getGlobalParameterName(int index) const {
+    ASSERT_VALID_INDEX(index, globalParameters);
+    return globalParameters[index].name;
+}
+
+void CompositeRMSDForce::setGlobalParameterName(int index, const string& name) {
+    ASSERT_VALID_INDEX(index, globalParameters);
+    globalParameters[index].name = name;
+}
+
+double CompositeRMSDForce::getGlobalParameterDefaultValue(int index) const {
+    ASSERT_VALID_INDEX(index, globalParameters);
+    return globalParameters[index].defaultValue;
+}
+
+void CompositeRMSDForce::setGlobalParameterDefaultValue(int index, double defaultValue) {
+    ASSERT_VALID_INDEX(index, globalParameters);
+    globalParameters[index].defaultValue = defaultValue;
+}
+
+void CompositeRMSDForce::setNumThreads(int threads) {
+    if (threads < 0)
+        throw OpenMMException("CompositeRMSDForce: The number of threads cannot be negative");
+    numThreads = threads;
+}
+
+void CompositeRMSDForce::setAlignmentTolerance(double tolerance) {
+    if (tolerance <= 0.0)
+        throw OpenMMException("CompositeRMSDForce: The alignment tolerance must be positive");
+    alignmentTolerance = tolerance;
 }
 
 void CompositeRMSDForce::updateParametersInContext(Context& context) {
     dynamic_cast<CompositeRMSDForceImpl&>(getImplInContext(context)).updateParametersInContext(getContextImpl(context));
 }
 
+void CompositeRMSDForce::getGroupRMSDs(Context& context, vector<double>& rmsds, int reference) {
+    ASSERT_VALID_INDEX(reference, referencePositions);
+    CompositeRMSDForceImpl& impl = dynamic_cast<CompositeRMSDForceImpl&>(getImplInContext(context));
+    impl.evaluateInContext(getContextImpl(context));
+    impl.getLastGroupRMSDs(reference, rmsds);
+}
+
+void CompositeRMSDForce::getOptimalRotation(Context& context, vector<double>& quaternion, int reference) {
+    ASSERT_VALID_INDEX(reference, referencePositions);
+    CompositeRMSDForceImpl& impl = dynamic_cast<CompositeRMSDForceImpl&>(getImplInContext(context));
+    impl.evaluateInContext(getContextImpl(context));
+    quaternion.resize(4);
+    impl.getLastQuaternion(reference, &quaternion[0]);
+}
+
+void CompositeRMSDForce::computeHessianTimesVector(Context& context, const vector<Vec3>& direction, vector<Vec3>& product) {
+    CompositeRMSDForceImpl& impl = dynamic_cast<CompositeRMSDForceImpl&>(getImplInContext(context));
+    impl.evaluateInContext(getContextImpl(context));
+    impl.computeHessianTimesVector(direction, product);
+}
+
+void CompositeRMSDForce::computeBatch(const double* frames, int numFrames, int numParticles, double* energies,
+                                      double* rmsds, double* gradients) const {
+    CompositeRMSDForceImpl::computeBatch(*this, frames, numFrames, numParticles, energies, rmsds, gradients);
+}
+
+void CompositeRMSDForce::getProfile(Context& context, map<string, double>& profile) {
+    dynamic_cast<CompositeRMSDForceImpl&>(getImplInContext(context)).getProfile(profile);
+}
+
+void CompositeRMSDForce::resetProfile(Context& context) {
+    dynamic_cast<CompositeRMSDForceImpl&>(getImplInContext(context)).resetProfile();
+}
+
 ForceImpl* CompositeRMSDForce::createImpl() const {
     return new CompositeRMSDForceImpl(*this);
 }
@@ -13,181 +13,1453 @@
 #include "openmm/internal/CustomCPPForceImpl.h"
 #include "openmm/internal/ContextImpl.h"
 #include "jama/jama_eig.h"
+#include "lepton/Parser.h"
+#include "lepton/ParsedExpression.h"
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <vector>
-#include <set>
 #include <sstream>
+#include <string>
 
 using namespace OpenMMCPPForces;
 using namespace OpenMM;
 using namespace std;
 
+// Find the largest eigenvalue of the key matrix F using the quaternion characteristic
+// polynomial (QCP) method of Theobald, "Rapid calculation of RMSDs using a
+// quaternion-based characteristic polynomial" (doi: 10.1107/S0108767305015266).
+// Because F is traceless, its characteristic polynomial is x^4 + c2*x^2 + c1*x + c0.
+// Newton iterations starting from an upper bound converge monotonically to the largest
+// root.  Starting from elsewhere, they might converge to another root, so the result is
+// checked.  Returns false if the iterations fail to converge within maxIterations, or
+// if the root is not the largest one, or if it is nearly degenerate.
+
+static bool findMaxEigenvalue(const double R[3][3], const double F[4][4], double start, double upperBound,
+                              double tolerance, int maxIterations, double& lambda) {
+    double c2 = 0.0;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            c2 += R[i][j]*R[i][j];
+    c2 *= -2.0;
+    double c1 = -8.0*(R[0][0]*(R[1][1]*R[2][2] - R[1][2]*R[2][1]) -
+                      R[0][1]*(R[1][0]*R[2][2] - R[1][2]*R[2][0]) +
+                      R[0][2]*(R[1][0]*R[2][1] - R[1][1]*R[2][0]));
+
+    // The determinant of F, expanded in terms of the 2x2 minors of its upper and lower halves.
+
+    double s01 = F[0][0]*F[1][1] - F[0][1]*F[1][0], c23 = F[2][2]*F[3][3] - F[2][3]*F[3][2];
+    double s02 = F[0][0]*F[1][2] - F[0][2]*F[1][0], c13 = F[2][1]*F[3][3] - F[2][3]*F[3][1];
+    double s03 = F[0][0]*F[1][3] - F[0][3]*F[1][0], c12 = F[2][1]*F[3][2] - F[2][2]*F[3][1];
+    double s12 = F[0][1]*F[1][2] - F[0][2]*F[1][1], c03 = F[2][0]*F[3][3] - F[2][3]*F[3][0];
+    double s13 = F[0][1]*F[1][3] - F[0][3]*F[1][1], c02 = F[2][0]*F[3][2] - F[2][2]*F[3][0];
+    double s23 = F[0][2]*F[1][3] - F[0][3]*F[1][2], c01 = F[2][0]*F[3][1] - F[2][1]*F[3][0];
+    double c0 = s01*c23 - s02*c13 + s03*c12 + s12*c03 - s13*c02 + s23*c01;
+
+    lambda = start;
+    for (int iteration = 0; iteration < maxIterations; iteration++) {
+        double x2 = lambda*lambda;
+        double b = (x2 + c2)*lambda;
+        double a = b + c1;
+        double derivative = 2*x2*lambda + b + a;
+        if (derivative == 0.0)
+            return false;
+        double delta = (a*lambda + c0)/derivative;
+        lambda -= delta;
+        if (fabs(delta) <= tolerance*fabs(lambda)) {
+            // By the Budan-Fourier theorem, no root is larger than lambda if the first three
+            // derivatives are positive there.  The first derivative also equals the product of
+            // the gaps to the other eigenvalues.  If it is too small, the largest eigenvalue is
+            // nearly degenerate and the root is inaccurate.
+
+            x2 = lambda*lambda;
+            derivative = 4*x2*lambda + 2*c2*lambda + c1;
+            return (lambda > 0 && 6*x2 + c2 > 0 && derivative > 1e-4*upperBound*upperBound*upperBound);
+        }
+    }
+    return false;
+}
+
+// Find the unit eigenvector of F corresponding to a simple eigenvalue lambda.  For a
+// symmetric matrix, every column of the adjugate of F - lambda*I is proportional to
+// it, and the diagonal element of each column is proportional to the squared length
+// of that column.  Returns false if the eigenvalue is too close to being degenerate.
+
+static bool findEigenvector(const double F[4][4], double lambda, double upperBound, double q[4]) {
+    double M[4][4];
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            M[i][j] = F[i][j];
+    for (int i = 0; i < 4; i++)
+        M[i][i] -= lambda;
+
+    // The cofactor of element (i, j) is computed from the rows and columns other than i and j.
+
+    auto cofactor = [&M] (int i, int j) {
+        int r[3], c[3];
+        for (int k = 0, m = 0, n = 0; k < 4; k++) {
+            if (k != i)
+                r[m++] = k;
+            if (k != j)
+                c[n++] = k;
+        }
+        double det = M[r[0]][c[0]]*(M[r[1]][c[1]]*M[r[2]][c[2]] - M[r[1]][c[2]]*M[r[2]][c[1]]) -
+                     M[r[0]][c[1]]*(M[r[1]][c[0]]*M[r[2]][c[2]] - M[r[1]][c[2]]*M[r[2]][c[0]]) +
+                     M[r[0]][c[2]]*(M[r[1]][c[0]]*M[r[2]][c[1]] - M[r[1]][c[1]]*M[r[2]][c[0]]);
+        return ((i+j)%2 == 0 ? det : -det);
+    };
+
+    int column = 0;
+    double diagonal = cofactor(0, 0);
+    for (int j = 1; j < 4; j++) {
+        double value = cofactor(j, j);
+        if (fabs(value) > fabs(diagonal)) {
+            column = j;
+            diagonal = value;
+        }
+    }
+    if (fabs(diagonal) <= 1e-8*upperBound*upperBound*upperBound)
+        return false;
+
+    double norm = 0.0;
+    for (int i = 0; i < 4; i++) {
+        q[i] = (i == column ? diagonal : cofactor(column, i));
+        norm += q[i]*q[i];
+    }
+    norm = sqrt(norm);
+    for (int i = 0; i < 4; i++)
+        q[i] /= norm;
+    return true;
+}
+
+// Find the largest eigenvalue of F and its eigenvector with a general purpose solver.
+// This is used as a fallback when the QCP method fails.
+
+static void findMaxEigenpair(const double F[4][4], double& lambda, double q[4]) {
+    Array2D<double> matrix(4, 4);
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            matrix[i][j] = F[i][j];
+    JAMA::Eigenvalue<double> eigen(matrix);
+    Array1D<double> values;
+    eigen.getRealEigenvalues(values);
+    Array2D<double> vectors;
+    eigen.getV(vectors);
+    lambda = values[3];
+    for (int i = 0; i < 4; i++)
+        q[i] = vectors[i][3];
+}
+
+// Build the key matrix F from the correlation matrix R.
+
+static void computeKeyMatrix(const double R[3][3], double F[4][4]) {
+    F[0][0] =  R[0][0] + R[1][1] + R[2][2];
+    F[1][0] =  R[1][2] - R[2][1];
+    F[2][0] =  R[2][0] - R[0][2];
+    F[3][0] =  R[0][1] - R[1][0];
+
+    F[0][1] =  R[1][2] - R[2][1];
+    F[1][1] =  R[0][0] - R[1][1] - R[2][2];
+    F[2][1] =  R[0][1] + R[1][0];
+    F[3][1] =  R[0][2] + R[2][0];
+
+    F[0][2] =  R[2][0] - R[0][2];
+    F[1][2] =  R[0][1] + R[1][0];
+    F[2][2] = -R[0][0] + R[1][1] - R[2][2];
+    F[3][2] =  R[1][2] + R[2][1];
+
+    F[0][3] =  R[0][1] - R[1][0];
+    F[1][3] =  R[0][2] + R[2][0];
+    F[2][3] =  R[1][2] + R[2][1];
+    F[3][3] = -R[0][0] - R[1][1] + R[2][2];
+}
+
+// Build the rotation matrix corresponding to a unit quaternion q.
+
+static void computeRotationMatrix(const double q[4], double U[3][3]) {
+    double q00 = q[0]*q[0], q01 = q[0]*q[1], q02 = q[0]*q[2], q03 = q[0]*q[3];
+    double q11 = q[1]*q[1], q12 = q[1]*q[2], q13 = q[1]*q[3];
+    double q22 = q[2]*q[2], q23 = q[2]*q[3];
+    double q33 = q[3]*q[3];
+    U[0][0] = q00+q11-q22-q33;
+    U[0][1] = 2*(q12-q03);
+    U[0][2] = 2*(q13+q02);
+    U[1][0] = 2*(q12+q03);
+    U[1][1] = q00-q11+q22-q33;
+    U[1][2] = 2*(q23-q01);
+    U[2][0] = 2*(q13-q02);
+    U[2][1] = 2*(q23+q01);
+    U[2][2] = q00-q11-q22+q33;
+}
+
+// The loops over particles are written for vectorization.  On x86 Linux, they are also
+// compiled for AVX2 and AVX-512, and the best version supported by the CPU is selected
+// when the library is loaded.  Elsewhere, they use the instruction set the library was
+// built for, which on ARM64 includes NEON.
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define VECTORIZED __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef VECTORIZED
+#define VECTORIZED
+#endif
+
+// The number of partial sums kept by the vectorized reductions.  Particle j is added to
+// partial sum j%LANES, so the result does not depend on the vector width.
+
+static const int LANES = 8;
+
+// The number of particles processed at a time while looping over references.
+
+static const int BLOCK_SIZE = 512;
+
+// The kernels below take positions and forces in the working precision REAL, which is
+// either double or float, and add up the contributions of particles in double.
+
+// Add up the squared norms of count centered positions.
+
+template <class REAL>
+VECTORIZED
+static double sumSquaredNorms(const REAL* x, const REAL* y, const REAL* z, int count,
+                              REAL cx, REAL cy, REAL cz) {
+    double partial[LANES] = {0};
+    int main = count - count%LANES;
+    for (int j = 0; j < main; j += LANES)
+        for (int l = 0; l < LANES; l++) {
+            REAL dx = x[j+l]-cx, dy = y[j+l]-cy, dz = z[j+l]-cz;
+            partial[l] += dx*dx + dy*dy + dz*dz;
+        }
+    for (int l = 0; l < count-main; l++) {
+        REAL dx = x[main+l]-cx, dy = y[main+l]-cy, dz = z[main+l]-cz;
+        partial[l] += dx*dx + dy*dy + dz*dz;
+    }
+    double sum = 0.0;
+    for (int l = 0; l < LANES; l++)
+        sum += partial[l];
+    return sum;
+}
+
+// Add the correlation matrix between count centered positions and their reference
+// positions to R.
+
+template <class REAL>
+VECTORIZED
+static void addCorrelation(const REAL* x, const REAL* y, const REAL* z,
+                           const REAL* rx, const REAL* ry, const REAL* rz,
+                           int count, REAL cx, REAL cy, REAL cz, double* R) {
+    double partial[9][LANES] = {{0}};
+    int main = count - count%LANES;
+    for (int j = 0; j < main; j += LANES)
+        for (int l = 0; l < LANES; l++) {
+            REAL dx = x[j+l]-cx, dy = y[j+l]-cy, dz = z[j+l]-cz;
+            partial[0][l] += dx*rx[j+l];
+            partial[1][l] += dx*ry[j+l];
+            partial[2][l] += dx*rz[j+l];
+            partial[3][l] += dy*rx[j+l];
+            partial[4][l] += dy*ry[j+l];
+            partial[5][l] += dy*rz[j+l];
+            partial[6][l] += dz*rx[j+l];
+            partial[7][l] += dz*ry[j+l];
+            partial[8][l] += dz*rz[j+l];
+        }
+    for (int l = 0; l < count-main; l++) {
+        int j = main+l;
+        REAL dx = x[j]-cx, dy = y[j]-cy, dz = z[j]-cz;
+        partial[0][l] += dx*rx[j];
+        partial[1][l] += dx*ry[j];
+        partial[2][l] += dx*rz[j];
+        partial[3][l] += dy*rx[j];
+        partial[4][l] += dy*ry[j];
+        partial[5][l] += dy*rz[j];
+        partial[6][l] += dz*rx[j];
+        partial[7][l] += dz*ry[j];
+        partial[8][l] += dz*rz[j];
+    }
+    for (int i = 0; i < 9; i++) {
+        double sum = 0.0;
+        for (int l = 0; l < LANES; l++)
+            sum += partial[i][l];
+        R[i] += sum;
+    }
+}
+
+// Set the forces on count particles to the term that does not depend on the references.
+
+template <class REAL>
+VECTORIZED
+static void initializeForces(const REAL* x, const REAL* y, const REAL* z, int count,
+                             REAL cx, REAL cy, REAL cz, REAL scale,
+                             REAL* fx, REAL* fy, REAL* fz) {
+    for (int j = 0; j < count; j++) {
+        fx[j] = scale*(cx-x[j]);
+        fy[j] = scale*(cy-y[j]);
+        fz[j] = scale*(cz-z[j]);
+    }
+}
+
+// Add the reference positions of count particles, rotated by the transpose of U, to
+// their forces.
+
+template <class REAL>
+VECTORIZED
+static void addRotatedReference(const REAL* rx, const REAL* ry, const REAL* rz, int count,
+                                const double* U, REAL* fx, REAL* fy, REAL* fz) {
+    REAL u[9];
+    for (int i = 0; i < 9; i++)
+        u[i] = U[i];
+    for (int j = 0; j < count; j++) {
+        fx[j] += u[0]*rx[j] + u[3]*ry[j] + u[6]*rz[j];
+        fy[j] += u[1]*rx[j] + u[4]*ry[j] + u[7]*rz[j];
+        fz[j] += u[2]*rx[j] + u[5]*ry[j] + u[8]*rz[j];
+    }
+}
+
+// Return the data held by another Context under the same key, or else the data filled
+// in by create(), which is then made available to other Contexts.  The data is only
+// created if no other Context holds it, and outside the lock, so that create() may throw.
+// An entry is removed when the last Context using its data is deleted or updated.  The
+// registry is never destroyed, since Contexts may still be deleted at exit.
+
+template <class T, class KEY, class CREATE>
+static shared_ptr<const T> findSharedData(const KEY& key, CREATE create) {
+    static mutex& registryMutex = *new mutex();
+    static map<KEY, weak_ptr<const T> >& registry = *new map<KEY, weak_ptr<const T> >();
+    {
+        lock_guard<mutex> lock(registryMutex);
+        auto entry = registry.find(key);
+        if (entry != registry.end()) {
+            shared_ptr<const T> data = entry->second.lock();
+            if (data != NULL)
+                return data;
+        }
+    }
+    unique_ptr<T> data(new T());
+    create(*data);
+    shared_ptr<const T> created(data.release(), [key] (const T* released) {
+        {
+            lock_guard<mutex> lock(registryMutex);
+            auto entry = registry.find(key);
+            if (entry != registry.end() && entry->second.expired())
+                registry.erase(entry);
+        }
+        delete released;
+    });
+
+    // Another Context may have registered the same data in the meantime.  The lock is
+    // released before the duplicate is deleted, since that takes the lock again.
+
+    lock_guard<mutex> lock(registryMutex);
+    weak_ptr<const T>& entry = registry[key];
+    shared_ptr<const T> existing = entry.lock();
+    if (existing != NULL)
+        return existing;
+    entry = created;
+    return created;
+}
 
 void CompositeRMSDForceImpl::updateParameters(int systemSize) {
-    // Check for errors in the specification of particles.
-    if (owner.getReferencePositions().size() != systemSize)
-        throw OpenMMException(
-            "CompositeRMSDForce: Number of reference positions does not equal number of particles in the System"
-        );
+    // Everything that can be rejected is checked and built in local variables first, so
+    // that the previous state is left untouched if the update fails.  Check for errors
+    // in the specification of particles.
 
+    int numReferences = owner.getNumReferences();
     int numGroups = owner.getNumGroups();
     if (numGroups == 0)
         throw OpenMMException("CompositeRMSDForce: No particle groups have been specified");
 
-    groups.resize(numGroups);
-    for (int i = 0; i < numGroups; i++) {
-        groups[i] = owner.getGroup(i);
-        if (groups[i].size() == 0) {
-            groups[i].resize(systemSize);
-            for (int j = 0; j < systemSize; j++)
-                groups[i][j] = j;
+    // Replace the layout of particles only if the groups have changed, as told by their
+    // revision.  If another Context of this force, or of a copy of it, has the same
+    // revision, its layout is reused instead of validating and sorting the groups again.
+
+    bool groupsChanged = (layout == NULL || !layoutMatches(*layout, systemSize));
+    shared_ptr<const ParticleLayout> newLayout = layout;
+    if (groupsChanged)
+        newLayout = findSharedData<ParticleLayout>(make_pair(owner.groupsRevision, systemSize),
+            [&] (ParticleLayout& created) {
+                createLayout(created, systemSize);
+            });
+    const vector<int>& groupOffsets = newLayout->groupOffsets;
+
+    // The full positions of a reference are only required if some group does not have
+    // its own positions for it.
+
+    for (int m = 0; m < numReferences; m++) {
+        const vector<Vec3>& positions = owner.getReferencePositions(m);
+        bool fullRequired = false;
+        for (int k = 0; k < numGroups; k++) {
+            const vector<Vec3>& groupPositions = owner.getGroupReferencePositions(k, m);
+            if (groupPositions.size() == 0)
+                fullRequired = true;
+            else if (groupPositions.size() != groupOffsets[k+1]-groupOffsets[k]) {
+                stringstream msg;
+                msg << "CompositeRMSDForce: Number of reference positions for group " << k << " does not equal its number of particles";
+                throw OpenMMException(msg.str());
+            }
         }
+        if ((fullRequired || positions.size() > 0) && positions.size() != systemSize)
+            throw OpenMMException(
+                "CompositeRMSDForce: Number of reference positions does not equal number of particles in the System"
+            );
     }
 
-    set<int> distinctParticles;
-    for (int k = 0; k < numGroups; k++)
-        for (int i : groups[k]) {
+    // Parse the energy function.  Its variables are the RMSDs with respect to the
+    // references, named rmsd0, rmsd1, etc., and the global parameters.
+
+    vector<string> parameterNames;
+    for (int i = 0; i < owner.getNumGlobalParameters(); i++)
+        parameterNames.push_back(owner.getGlobalParameterName(i));
+    Lepton::ParsedExpression parsed = Lepton::Parser::parse(owner.getEnergyFunction()).optimize();
+    Lepton::CompiledExpression compiledEnergy = parsed.createCompiledExpression();
+    vector<Lepton::CompiledExpression> derivatives;
+    vector<int> references;
+    map<string, int> variables;
+    for (const string& name : compiledEnergy.getVariables()) {
+        int m = findVariable(name, parameterNames, numReferences);
+        variables[name] = m;
+        if (m >= 0) {
+            derivatives.push_back(parsed.differentiate(name).createCompiledExpression());
+            references.push_back(m);
+        }
+    }
+
+    // Nothing below depends on user input that may be invalid.  The forces on particles
+    // that no longer belong to any group must be cleared before the next evaluation.  If
+    // there are too many of them, it is cheaper to clear the whole force array.
+
+    if (groupsChanged) {
+        if (!resetForces && layout != NULL) {
+            vector<char> current(systemSize, 0);
+            for (int i : newLayout->particles)
+                current[i] = 1;
+            for (int i : layout->particles)
+                if (!current[i])
+                    staleParticles.push_back(i);
+            if (staleParticles.size() > systemSize) {
+                staleParticles.resize(0);
+                resetForces = true;
+            }
+        }
+        layout = newLayout;
+    }
+    chunkSums.resize(layout->chunkGroups.size()*(9*numReferences+1));
+
+    // Store the reference and current positions in the working precision.
+
+    mixedPrecision = owner.getUseMixedPrecision();
+    if (mixedPrecision)
+        initializeArrays<float>();
+    else
+        initializeArrays<double>();
+
+    // Record where the value of each variable must be written before evaluating the
+    // expressions.  RMSDs are indexed from 0 and global parameters from -1 downwards.
+
+    globalParameterNames.swap(parameterNames);
+    globalValues.assign(globalParameterNames.size(), 0.0);
+    parsedEnergy = parsed;
+    energyExpression = compiledEnergy;
+    derivativeExpressions.swap(derivatives);
+    derivativeReferences.swap(references);
+    variableBindings.resize(0);
+    auto bindVariables = [&] (Lepton::CompiledExpression& compiled) {
+        for (const string& name : compiled.getVariables())
+            variableBindings.push_back(make_pair(&compiled.getVariableReference(name), variables[name]));
+    };
+    bindVariables(energyExpression);
+    for (auto& derivative : derivativeExpressions)
+        bindVariables(derivative);
+    secondDerivativesReady = false;
+
+    centers.resize(3*numGroups);
+    groupSums.resize(numGroups*(9*numReferences+1));
+    correlations.resize(9*numReferences);
+    keyMatrices.resize(16*numReferences);
+    maxEigenvalues.resize(numReferences);
+    eigenvalueConverged.resize(numReferences);
+    rmsds.resize(numReferences);
+    energyDerivatives.resize(numReferences);
+    rotations.resize(9*numReferences);
+
+    // Create a thread pool if the computation is to be parallelized.  With autotuning,
+    // the number of threads found before is kept unless something that affects the
+    // timings has changed.
+
+    int maxThreads = (serial ? 1 : owner.getNumThreads() == 0 ? ThreadPool::getNumProcessors() : owner.getNumThreads());
+    bool autotune = (owner.getUseAutotuning() && maxThreads > 1);
+    auto tuningKey = make_tuple(layout, maxThreads, numReferences, mixedPrecision);
+    bool retune = (autotune && (tuningKey != tunedFor));
+    if (!autotune || retune)
+        setThreads(maxThreads);
+    cacheValid = false;
+
+    useWarmStart = owner.getUseWarmStart();
+    tolerance = owner.getAlignmentTolerance();
+    profiling = owner.getUseProfiling();
+    lastQuaternions.resize(4*numReferences);
+    hasLastQuaternion.assign(numReferences, 0);
+
+    // Select the kernels for the working precision.
+
+    if (mixedPrecision)
+        selectKernels<float>();
+    else
+        selectKernels<double>();
+    if (retune) {
+        autotuneThreads(systemSize, maxThreads);
+        tunedFor = tuningKey;
+    }
+    else if (!autotune)
+        tunedFor = make_tuple(shared_ptr<const ParticleLayout>(), 0, 0, false);
+}
+
+int CompositeRMSDForceImpl::findVariable(const string& name, const vector<string>& parameterNames, int numReferences) const {
+    // Return the index of the reference for an RMSD, or -1-i for global parameter i.
+
+    for (int i = 0; i < parameterNames.size(); i++)
+        if (name == parameterNames[i])
+            return -1-i;
+    int m = -1;
+    if (name.size() > 4 && name.substr(0, 4) == "rmsd" && name.find_first_not_of("0123456789", 4) == string::npos)
+        stringstream(name.substr(4)) >> m;
+    if (m < 0 || m >= numReferences || name != "rmsd"+to_string(m))
+        throw OpenMMException("CompositeRMSDForce: Unknown variable '"+name+"' in energy function");
+    return m;
+}
+
+bool CompositeRMSDForceImpl::layoutMatches(const ParticleLayout& layout, int systemSize) const {
+    return layout.systemSize == systemSize && layout.groupsRevision == owner.groupsRevision;
+}
+
+void CompositeRMSDForceImpl::createLayout(ParticleLayout& layout, int systemSize) const {
+    int numGroups = owner.getNumGroups();
+    vector<int>& particles = layout.particles;
+    vector<int>& groupOffsets = layout.groupOffsets;
+
+    // Record the group each particle belongs to, or -1 if it belongs to none.  This
+    // detects illegal and duplicated indices in a single pass.
+
+    vector<int> particleGroup(systemSize, -1), particleRank(systemSize);
+    groupOffsets.resize(numGroups+1);
+    groupOffsets[0] = 0;
+    for (int k = 0; k < numGroups; k++) {
+        const vector<int>& group = owner.getGroup(k);
+        pair<int, int> range = getGroupRange(k);
+        if (range.second > systemSize) {
+            stringstream msg;
+            msg << "CompositeRMSDForce: Illegal particle range in group " << k;
+            throw OpenMMException(msg.str());
+        }
+        if (group.size() == 0 && range.second == 0)
+            range.second = systemSize;
+        int groupSize = (group.size() == 0 ? range.second-range.first : group.size());
+        for (int j = 0; j < groupSize; j++) {
+            int i = (group.size() == 0 ? range.first+j : group[j]);
             if (i < 0 || i >= systemSize) {
                 stringstream msg;
                 msg << "CompositeRMSDForce: Illegal particle index " << i << " in group " << k;
                 throw OpenMMException(msg.str());
             }
-            if (distinctParticles.find(i) != distinctParticles.end()) {
+            if (particleGroup[i] != -1) {
                 stringstream msg;
                 msg << "CompositeRMSDForce: Duplicated particle index " << i << " in group " << k;
                 throw OpenMMException(msg.str());
             }
-            distinctParticles.insert(i);
+            particleGroup[i] = k;
+            particleRank[i] = j;
         }
-
-    referencePos.resize(0);
-    const vector<Vec3>& positions = owner.getReferencePositions();
-    for (auto& group : groups) {
-        Vec3 center(0.0, 0.0, 0.0);
-        for (int i : group)
-            center += positions[i];
-        center /= group.size();
-        for (int i : group)
-            referencePos.push_back(positions[i] - center);
+        groupOffsets[k+1] = groupOffsets[k]+groupSize;
     }
 
-    sumRefPosSq = 0.0;
-    for (auto& p : referencePos)
-        sumRefPosSq += p.dot(p);
+    // Store the groups contiguously, with the particles of group k located between
+    // groupOffsets[k] and groupOffsets[k+1].  The order of particles within a group does
+    // not affect the RMSD, so they are stored in increasing order to make gathering
+    // positions and scattering forces sweep through memory in a single direction.
 
-    resetForces = true;
+    particles.resize(groupOffsets[numGroups]);
+    layout.particleRanks.resize(groupOffsets[numGroups]);
+    vector<int> next(groupOffsets.begin(), groupOffsets.end()-1);
+    for (int i = 0; i < systemSize; i++)
+        if (particleGroup[i] != -1) {
+            int j = next[particleGroup[i]]++;
+            particles[j] = i;
+            layout.particleRanks[j] = particleRank[i];
+        }
+
+    // Split each group into chunks of at most BLOCK_SIZE particles.  These are the units
+    // of work distributed among threads.  Each chunk has its own partial sums, which are
+    // added up in chunk order, so the results do not depend on the number of threads.
+    // If the particles of a chunk are consecutive, as in ranges, its positions and
+    // forces are accessed directly rather than through the particle indices.
+
+    for (int k = 0; k < numGroups; k++)
+        for (int j = groupOffsets[k]; j < groupOffsets[k+1]; j += BLOCK_SIZE) {
+            int last = min(j+BLOCK_SIZE, groupOffsets[k+1])-1;
+            layout.chunkOffsets.push_back(j);
+            layout.chunkGroups.push_back(k);
+            layout.chunkFirstParticles.push_back(particles[last]-particles[j] == last-j ? particles[j] : -1);
+        }
+    layout.chunkOffsets.push_back(particles.size());
+    layout.systemSize = systemSize;
+    layout.groupsRevision = owner.groupsRevision;
+}
+
+pair<int, int> CompositeRMSDForceImpl::getGroupRange(int index) const {
+    pair<int, int> range(0, 0);
+    if (owner.getGroupIsRange(index))
+        owner.getGroupRange(index, range.first, range.second);
+    return range;
+}
+
+template <>
+CompositeRMSDForceImpl::ParticleArrays<double>& CompositeRMSDForceImpl::getArrays<double>() {
+    return doubleArrays;
+}
+
+template <>
+CompositeRMSDForceImpl::ParticleArrays<float>& CompositeRMSDForceImpl::getArrays<float>() {
+    return floatArrays;
+}
+
+template <class REAL>
+void CompositeRMSDForceImpl::initializeArrays() {
+    // Store the centered positions of each reference as separate arrays of coordinates,
+    // one reference after the other.  The sums of squared norms are computed from the
+    // rounded values, so that they are consistent with the correlation matrices.  If
+    // another Context has arrays for the same layout and revision of the references,
+    // they are shared rather than built again.
+
+    int numReferences = owner.getNumReferences();
+    int numGroups = layout->groupOffsets.size()-1;
+    int numParticles = layout->particles.size();
+    const vector<int>& particles = layout->particles;
+    const vector<int>& particleRanks = layout->particleRanks;
+    const vector<int>& groupOffsets = layout->groupOffsets;
+    doubleArrays = ParticleArrays<double>();
+    floatArrays = ParticleArrays<float>();
+    ParticleArrays<REAL>& arrays = getArrays<REAL>();
+    arrays.references = findSharedData<ReferenceArrays<REAL> >(make_pair(layout.get(), owner.referencesRevision),
+        [&] (ReferenceArrays<REAL>& references) {
+            references.layout = layout;
+            references.refX.resize(numReferences*numParticles);
+            references.refY.resize(numReferences*numParticles);
+            references.refZ.resize(numReferences*numParticles);
+            references.sumRefPosSq.assign(numReferences, 0.0);
+            references.groupSumRefPosSq.assign(numGroups*numReferences, 0.0);
+            for (int m = 0; m < numReferences; m++) {
+                const vector<Vec3>& positions = owner.getReferencePositions(m);
+                for (int k = 0; k < numGroups; k++) {
+                    // Positions given for the group are in the order of its list of particles.
+                    const vector<Vec3>& groupPositions = owner.getGroupReferencePositions(k, m);
+                    bool useGroupPositions = (groupPositions.size() > 0);
+                    Vec3 center(0.0, 0.0, 0.0);
+                    for (int j = groupOffsets[k]; j < groupOffsets[k+1]; j++)
+                        center += (useGroupPositions ? groupPositions[particleRanks[j]] : positions[particles[j]]);
+                    center /= groupOffsets[k+1]-groupOffsets[k];
+                    double& groupSum = references.groupSumRefPosSq[numReferences*k+m];
+                    for (int j = groupOffsets[k]; j < groupOffsets[k+1]; j++) {
+                        Vec3 p = (useGroupPositions ? groupPositions[particleRanks[j]] : positions[particles[j]]) - center;
+                        REAL x = p[0], y = p[1], z = p[2];
+                        references.refX[m*numParticles+j] = x;
+                        references.refY[m*numParticles+j] = y;
+                        references.refZ[m*numParticles+j] = z;
+                        groupSum += (double) x*x + (double) y*y + (double) z*z;
+                    }
+                    references.sumRefPosSq[m] += groupSum;
+                }
+            }
+        });
+    sumRefPosSq = arrays.references->sumRefPosSq;
+    groupSumRefPosSq = arrays.references->groupSumRefPosSq;
+    arrays.posX.resize(numParticles);
+    arrays.posY.resize(numParticles);
+    arrays.posZ.resize(numParticles);
+    arrays.forceX.resize(numParticles);
+    arrays.forceY.resize(numParticles);
+    arrays.forceZ.resize(numParticles);
+}
+
+template <class REAL>
+void CompositeRMSDForceImpl::selectKernels() {
+    sumPositionsKernel = &CompositeRMSDForceImpl::sumPositions<REAL>;
+    accumulateCorrelationKernel = &CompositeRMSDForceImpl::accumulateCorrelation<REAL>;
+    computeForcesKernel = &CompositeRMSDForceImpl::computeForces<REAL>;
 }
 
 void CompositeRMSDForceImpl::initialize(ContextImpl& context) {
     CustomCPPForceImpl::initialize(context);
+    resetForces = true;
     updateParameters(context.getSystem().getNumParticles());
 }
 
+/**
+ * The force whose energy alone is being computed in the current thread, if any.
+ */
+static thread_local const CompositeRMSDForceImpl* energyOnlyForce = NULL;
+
+double CompositeRMSDForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
+    // Record whether forces are needed, so that computeForce() can skip them if not.  The
+    // Reference and CPU platforms call computeForce() from within this method.  The GPU
+    // platforms call it from a worker thread as soon as the positions are available,
+    // before this method is called, to overlap it with their kernels.  The flag is only
+    // visible in the calling thread, so forces are always computed in that case.
+
+    energyOnlyForce = (includeForces ? NULL : this);
+    double energy = CustomCPPForceImpl::calcForcesAndEnergy(context, includeForces, includeEnergy, groups);
+    energyOnlyForce = NULL;
+    return energy;
+}
+
 double CompositeRMSDForceImpl::computeForce(ContextImpl& context, const vector<Vec3>& positions, vector<Vec3>& forces) {
-    // Compute the RMSD and its gradient using the algorithm described in Coutsias et al,
-    // "Using quaternions to calculate RMSD" (doi: 10.1002/jcc.20110).  First subtract
-    // the centroid from the atom positions.  The reference positions have already been centered.
+    forcesRequested = (energyOnlyForce != this);
+    updateGlobalValues(context);
+    return evaluate(&positions[0], forces);
+}
 
-    int numParticles = referencePos.size();
-    vector<Vec3> centeredPos(numParticles);
-    int index = 0;
-    for (auto& group : groups) {
-        Vec3 center(0.0, 0.0, 0.0);
-        for (int i : group)
-            center += positions[i];
-        center /= group.size();
-        for (int i : group)
-            centeredPos[index++] = positions[i] - center;
+void CompositeRMSDForceImpl::evaluateInContext(ContextImpl& context) {
+    // The positions are obtained in the same way as for a force evaluation, so the cached
+    // result is reused if they have not changed.  Only the energy is computed, and the
+    // force array of the Context is left untouched.
+
+    context.getPositions(contextPositions);
+    forcesRequested = false;
+    updateGlobalValues(context);
+    vector<Vec3> noForces;
+    evaluate(&contextPositions[0], noForces);
+}
+
+void CompositeRMSDForceImpl::updateGlobalValues(ContextImpl& context) {
+    // A change in the global parameters invalidates the cached result.
+
+    for (int i = 0; i < globalParameterNames.size(); i++) {
+        double value = context.getParameter(globalParameterNames[i]);
+        if (value != globalValues[i]) {
+            globalValues[i] = value;
+            cacheValid = false;
+        }
     }
+}
 
-    // Compute the correlation matrix.
+double CompositeRMSDForceImpl::evaluate(const Vec3* positions, vector<Vec3>& forces) {
+    // Compute the RMSDs and their gradients using the algorithm described in Coutsias et al,
+    // "Using quaternions to calculate RMSD" (doi: 10.1002/jcc.20110).  The reference
+    // positions have already been centered.  A first pass over the particles computes the
+    // centroid of each group, and a second one subtracts it from the atom positions while
+    // accumulating, for every group, the correlation matrices with all references and the
+    // sum of squared norms.  The per-group sums are kept to compute the deviation of each
+    // group on request.  Both passes and the final force computation are split among
+    // threads by chunks of particles, if requested.  The partial sums of each chunk are
+    // added up in a fixed order, so the results are the same for any number of threads.
+    // Only the forces on particles that belong, or used to belong, to a group are written,
+    // and only when forces are requested, since the array is not that of the Context for
+    // evaluations made by evaluateInContext().
 
-    double R[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
-    for (int i = 0; i < 3; i++)
-        for (int j = 0; j < 3; j++)
-            for (int index = 0; index < numParticles; index++)
-                R[i][j] += centeredPos[index][i]*referencePos[index][j];
+    if (forcesRequested) {
+        if (resetForces) {
+            fill(forces.begin(), forces.end(), Vec3(0, 0, 0));
+            resetForces = false;
+        }
+        for (int i : staleParticles)
+            forces[i] = Vec3(0, 0, 0);
+        staleParticles.resize(0);
+    }
 
-    // Compute the F matrix.
+    // When profiling, the time since the previous lap is added to the phase just ended.
 
-    Array2D<double> F(4, 4);
-    F[0][0] =  R[0][0] + R[1][1] + R[2][2];
-    F[1][0] =  R[1][2] - R[2][1];
-    F[2][0] =  R[2][0] - R[0][2];
-    F[3][0] =  R[0][1] - R[1][0];
+    chrono::steady_clock::time_point lapStart;
+    if (profiling) {
+        lapStart = chrono::steady_clock::now();
+        profile.evaluations++;
+    }
+    auto lap = [&] (double& time) {
+        if (profiling) {
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            time += chrono::duration<double>(now-lapStart).count();
+            lapStart = now;
+        }
+    };
 
-    F[0][1] =  R[1][2] - R[2][1];
-    F[1][1] =  R[0][0] - R[1][1] - R[2][2];
-    F[2][1] =  R[0][1] + R[1][0];
-    F[3][1] =  R[0][2] + R[2][0];
+    const vector<int>& groupOffsets = layout->groupOffsets;
+    const vector<int>& chunkGroups = layout->chunkGroups;
+    int numGroups = groupOffsets.size()-1;
+    int numReferences = sumRefPosSq.size();
+    int numParticles = layout->particles.size();
+    int numChunks = chunkGroups.size();
+    execute(numChunks, [&] (int first, int last, int thread) {
+        threadChanged[thread] = (this->*sumPositionsKernel)(positions, first, last);
+    });
+    lap(profile.gatherTime);
 
-    F[0][2] =  R[2][0] - R[0][2];
-    F[1][2] =  R[0][1] + R[1][0];
-    F[2][2] = -R[0][0] + R[1][1] - R[2][2];
-    F[3][2] =  R[1][2] + R[2][1];
+    // If the positions are the same as in the previous evaluation, return the cached
+    // result.  The forces computed then are still in the force array.
 
-    F[0][3] =  R[0][1] - R[1][0];
-    F[1][3] =  R[0][2] + R[2][0];
-    F[2][3] =  R[1][2] + R[2][1];
-    F[3][3] = -R[0][0] - R[1][1] + R[2][2];
+    if (cacheValid && (cacheHasForces || !forcesRequested) &&
+            find(threadChanged.begin(), threadChanged.end(), 1) == threadChanged.end()) {
+        if (profiling)
+            profile.cacheHits++;
+        return cachedEnergy;
+    }
+    cacheValid = true;
+    cacheHasForces = forcesRequested;
 
-    // Find the maximum eigenvalue and eigenvector.
+    fill(centers.begin(), centers.end(), 0.0);
+    for (int c = 0; c < numChunks; c++)
+        for (int i = 0; i < 3; i++)
+            centers[3*chunkGroups[c]+i] += chunkSums[3*c+i];
+    for (int k = 0; k < numGroups; k++)
+        for (int i = 0; i < 3; i++)
+            centers[3*k+i] /= groupOffsets[k+1]-groupOffsets[k];
+    int groupSize = 9*numReferences+1;
+    execute(numChunks, [&] (int first, int last, int thread) {
+        (this->*accumulateCorrelationKernel)(first, last);
+    });
+    fill(groupSums.begin(), groupSums.end(), 0.0);
+    for (int c = 0; c < numChunks; c++)
+        for (int i = 0; i < groupSize; i++)
+            groupSums[groupSize*chunkGroups[c]+i] += chunkSums[groupSize*c+i];
+    fill(correlations.begin(), correlations.end(), 0.0);
+    sumPosSq = 0.0;
+    for (int k = 0; k < numGroups; k++) {
+        const double* sums = &groupSums[groupSize*k];
+        for (int i = 0; i < 9*numReferences; i++)
+            correlations[i] += sums[i];
+        sumPosSq += sums[9*numReferences];
+    }
+    lap(profile.correlationTime);
 
-    JAMA::Eigenvalue<double> eigen(F);
-    Array1D<double> values;
-    eigen.getRealEigenvalues(values);
-    Array2D<double> vectors;
-    eigen.getV(vectors);
+    // Find the RMSD with respect to each reference.  The maximum eigenvalue of its key
+    // matrix F is found by Newton iteration on the characteristic polynomial.  Half the
+    // sum of squared norms is an upper bound for it.  With warm starts, a few iterations
+    // are first tried from the Rayleigh quotient of the previous eigenvector, which is a
+    // lower bound very close to the eigenvalue for small steps.
+
+    for (int m = 0; m < numReferences; m++) {
+        double (*R)[3] = reinterpret_cast<double (*)[3]>(&correlations[9*m]);
+        double (*F)[4] = reinterpret_cast<double (*)[4]>(&keyMatrices[16*m]);
+        computeKeyMatrix(R, F);
+        double sum = sumRefPosSq[m] + sumPosSq;
+        double& lambda = maxEigenvalues[m];
+        bool converged = false;
+        if (useWarmStart && hasLastQuaternion[m]) {
+            const double* q = &lastQuaternions[4*m];
+            double rayleigh = 0.0;
+            for (int i = 0; i < 4; i++)
+                for (int j = 0; j < 4; j++)
+                    rayleigh += q[i]*F[i][j]*q[j];
+            converged = findMaxEigenvalue(R, F, rayleigh, 0.5*sum, tolerance, 5, lambda);
+            if (profiling && !converged)
+                profile.warmStartFallbacks++;
+        }
+        if (!converged)
+            converged = findMaxEigenvalue(R, F, 0.5*sum, 0.5*sum, tolerance, 50, lambda);
+        if (!converged) {
+            findMaxEigenpair(F, lambda, &lastQuaternions[4*m]);
+            if (profiling)
+                profile.solverFallbacks++;
+        }
+        eigenvalueConverged[m] = converged;
 
-    // Compute the RMSD.
+        // If the particles are perfectly aligned, the RMSD is zero and its gradient is
+        // undefined.  Numerical error can lead to NaNs, so the gradient is taken as zero.
 
-    double sum = sumRefPosSq;
-    for (auto& p : centeredPos)
-        sum += p.dot(p);
+        double msd = (sum - 2*lambda)/numParticles;
+        rmsds[m] = (msd < 1e-20 ? 0.0 : sqrt(msd));
+        if (profiling && rmsds[m] == 0.0)
+            profile.zeroRMSDs++;
+    }
 
-    double msd = (sum - 2*values[3])/numParticles;
-    if (msd < 1e-20) {
-        // The particles are perfectly aligned, so all the forces should be zero.
-        // Numerical error can lead to NaNs, so just return 0 now.
-        for (auto& group : groups)
-            for (int i : group)
-                forces[i] = Vec3(0, 0, 0);
-        return 0.0;
+    // Evaluate the energy and its derivatives with respect to the RMSDs.
+
+    for (auto& binding : variableBindings)
+        *binding.first = (binding.second >= 0 ? rmsds[binding.second] : globalValues[-1-binding.second]);
+    double energy = energyExpression.evaluate();
+    fill(energyDerivatives.begin(), energyDerivatives.end(), 0.0);
+    for (int i = 0; i < derivativeExpressions.size(); i++)
+        energyDerivatives[derivativeReferences[i]] = derivativeExpressions[i].evaluate();
+    cachedEnergy = energy;
+    lap(profile.eigenTime);
+    if (!forcesRequested) {
+        if (profiling)
+            profile.energyOnly++;
+        return energy;
     }
-    double rmsd = sqrt(msd);
 
-    // Compute the rotation matrix.
+    // Find the optimal rotation with respect to each reference that contributes to the
+    // forces.  The eigenvector corresponding to the maximum eigenvalue is obtained from
+    // the adjugate of F - lambda*I, unless the eigenvalue is nearly degenerate.  The
+    // gradient of each RMSD is (x - U*y)/(n*rmsd), where x and y are the centered
+    // positions and U is the rotation matrix.  The centroids do not contribute, because
+    // the rotated deviations of each group add up to zero.
 
-    double q[] = {vectors[0][3], vectors[1][3], vectors[2][3], vectors[3][3]};
-    double q00 = q[0]*q[0], q01 = q[0]*q[1], q02 = q[0]*q[2], q03 = q[0]*q[3];
-    double q11 = q[1]*q[1], q12 = q[1]*q[2], q13 = q[1]*q[3];
-    double q22 = q[2]*q[2], q23 = q[2]*q[3];
-    double q33 = q[3]*q[3];
-    double U[3][3] = {{q00+q11-q22-q33, 2*(q12-q03), 2*(q13+q02)},
-                      {2*(q12+q03), q00-q11+q22-q33, 2*(q23-q01)},
-                      {2*(q13-q02), 2*(q23+q01), q00-q11-q22+q33}};
+    activeReferences.resize(0);
+    positionScale = 0.0;
+    for (int m = 0; m < numReferences; m++) {
+        if (energyDerivatives[m] == 0.0 || rmsds[m] == 0.0)
+            continue;
+        double (*F)[4] = reinterpret_cast<double (*)[4]>(&keyMatrices[16*m]);
+        double sum = sumRefPosSq[m] + sumPosSq;
+        double* q = &lastQuaternions[4*m];
+        if (eigenvalueConverged[m] && !findEigenvector(F, maxEigenvalues[m], 0.5*sum, q)) {
+            findMaxEigenpair(F, maxEigenvalues[m], q);
+            if (profiling)
+                profile.solverFallbacks++;
+        }
+        hasLastQuaternion[m] = 1;
+        double U[3][3];
+        computeRotationMatrix(q, U);
+        double scale = energyDerivatives[m]/(numParticles*rmsds[m]);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                rotations[9*m+3*i+j] = scale*U[i][j];
+        positionScale += scale;
+        activeReferences.push_back(m);
+    }
 
     // Rotate the reference positions and compute the forces.
 
-    if (resetForces) {
-        fill(forces.begin(), forces.end(), Vec3(0, 0, 0));
-        resetForces = false;
+    execute(numChunks, [&] (int first, int last, int thread) {
+        (this->*computeForcesKernel)(first, last, forces);
+    });
+    lap(profile.forceTime);
+    return energy;
+}
+
+map<string, double> CompositeRMSDForceImpl::getDefaultParameters() {
+    map<string, double> parameters;
+    for (int i = 0; i < owner.getNumGlobalParameters(); i++)
+        parameters[owner.getGlobalParameterName(i)] = owner.getGlobalParameterDefaultValue(i);
+    return parameters;
+}
+
+void CompositeRMSDForceImpl::setThreads(int count) {
+    if (count == 1)
+        threads.reset();
+    else if (threads == NULL || threads->getNumThreads() != count)
+        threads.reset(new ThreadPool(count));
+    numThreads = (threads == NULL ? 1 : threads->getNumThreads());
+    threadChanged.resize(numThreads);
+}
+
+void CompositeRMSDForceImpl::autotuneThreads(int systemSize, int maxThreads) {
+    // Time the passes over the particles with 1, 2, 4, ... threads, up to the maximum,
+    // and keep the fastest.  The rest of the evaluation does not depend on the number of
+    // threads, and neither do the results.  The positions are arbitrary, since the
+    // kernels do the same work for any values.  There is no point in having more
+    // threads than chunks of particles.
+
+    vector<Vec3> positions(systemSize), forces(systemSize);
+    int numReferences = sumRefPosSq.size();
+    int numChunks = layout->chunkGroups.size();
+    activeReferences.resize(numReferences);
+    for (int m = 0; m < numReferences; m++)
+        activeReferences[m] = m;
+    fill(rotations.begin(), rotations.end(), 0.0);
+    positionScale = 0.0;
+    auto pass = [&] () {
+        execute(numChunks, [&] (int first, int last, int thread) {
+            (this->*sumPositionsKernel)(&positions[0], first, last);
+        });
+        execute(numChunks, [&] (int first, int last, int thread) {
+            (this->*accumulateCorrelationKernel)(first, last);
+        });
+        execute(numChunks, [&] (int first, int last, int thread) {
+            (this->*computeForcesKernel)(first, last, forces);
+        });
+    };
+    vector<int> candidates;
+    for (int count = 1; count < maxThreads && count <= numChunks; count *= 2)
+        candidates.push_back(count);
+    if (maxThreads <= numChunks)
+        candidates.push_back(maxThreads);
+    int bestThreads = 1;
+    double bestTime = 0.0;
+    for (int count : candidates) {
+        setThreads(count);
+        pass();
+        int repeats = 0;
+        double elapsed;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        do {
+            pass();
+            repeats++;
+            elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        } while (elapsed < 2e-3 && repeats < 100);
+        if (count == 1 || elapsed/repeats < bestTime) {
+            bestTime = elapsed/repeats;
+            bestThreads = count;
+        }
     }
+    setThreads(bestThreads);
+}
 
-    index = 0;
-    for (auto& group : groups) {
-        double scale = 1.0 / (rmsd*group.size());
-        for (int i : group) {
-            const Vec3& p = referencePos[index];
-            Vec3 rotatedRef(
-                U[0][0]*p[0] + U[1][0]*p[1] + U[2][0]*p[2],
-                U[0][1]*p[0] + U[1][1]*p[1] + U[2][1]*p[2],
-                U[0][2]*p[0] + U[1][2]*p[1] + U[2][2]*p[2]
-            );
-            forces[i] = scale * (rotatedRef - centeredPos[index]);
-            index++;
+void CompositeRMSDForceImpl::execute(int count, const function<void (int, int, int)>& task) {
+    if (threads == NULL)
+        task(0, count, 0);
+    else {
+        threads->execute([&] (ThreadPool& pool, int thread) {
+            int first = (int) ((long long) thread*count/numThreads);
+            int last = (int) ((long long) (thread+1)*count/numThreads);
+            task(first, last, thread);
+        });
+        threads->waitForThreads();
+    }
+}
+
+template <class REAL>
+bool CompositeRMSDForceImpl::sumPositions(const Vec3* positions, int first, int last) {
+    // Gather the positions of particles in chunks first to last-1, rounded to the working
+    // precision, and add them up by chunk.  Also check whether any of them differs from
+    // the position gathered in the previous call.
+
+    const vector<int>& particles = layout->particles;
+    const vector<int>& chunkOffsets = layout->chunkOffsets;
+    ParticleArrays<REAL>& arrays = getArrays<REAL>();
+    REAL* posX = &arrays.posX[0];
+    REAL* posY = &arrays.posY[0];
+    REAL* posZ = &arrays.posZ[0];
+    bool changed = false;
+    for (int c = first; c < last; c++) {
+        int start = chunkOffsets[c], firstParticle = layout->chunkFirstParticles[c];
+        double sx = 0, sy = 0, sz = 0;
+        for (int j = start; j < chunkOffsets[c+1]; j++) {
+            const Vec3& p = positions[firstParticle >= 0 ? firstParticle+j-start : particles[j]];
+            REAL x = p[0], y = p[1], z = p[2];
+            changed |= (x != posX[j] || y != posY[j] || z != posZ[j]);
+            posX[j] = x;
+            posY[j] = y;
+            posZ[j] = z;
+            sx += x;
+            sy += y;
+            sz += z;
+        }
+        chunkSums[3*c] = sx;
+        chunkSums[3*c+1] = sy;
+        chunkSums[3*c+2] = sz;
+    }
+    return changed;
+}
+
+template <class REAL>
+void CompositeRMSDForceImpl::accumulateCorrelation(int first, int last) {
+    // Compute, for each chunk first to last-1, with the gathered positions centered, the
+    // correlation matrices with all references and the sum of squared norms.  A chunk
+    // is small enough to stay in cache while looping over references.
+
+    int numReferences = sumRefPosSq.size();
+    int numParticles = layout->particles.size();
+    int groupSize = 9*numReferences+1;
+    const vector<int>& chunkOffsets = layout->chunkOffsets;
+    ParticleArrays<REAL>& arrays = getArrays<REAL>();
+    const ReferenceArrays<REAL>& references = *arrays.references;
+    for (int c = first; c < last; c++) {
+        int k = layout->chunkGroups[c];
+        int start = chunkOffsets[c], count = chunkOffsets[c+1]-start;
+        REAL cx = centers[3*k], cy = centers[3*k+1], cz = centers[3*k+2];
+        double* sums = &chunkSums[groupSize*c];
+        fill(sums, sums+groupSize, 0.0);
+        const REAL* x = &arrays.posX[start];
+        const REAL* y = &arrays.posY[start];
+        const REAL* z = &arrays.posZ[start];
+        sums[9*numReferences] = sumSquaredNorms(x, y, z, count, cx, cy, cz);
+        for (int m = 0; m < numReferences; m++) {
+            int offset = m*numParticles+start;
+            addCorrelation(x, y, z, &references.refX[offset], &references.refY[offset], &references.refZ[offset],
+                           count, cx, cy, cz, &sums[9*m]);
         }
     }
-    return rmsd;
+}
+
+template <class REAL>
+void CompositeRMSDForceImpl::computeForces(int first, int last, vector<Vec3>& forces) {
+    // Compute the forces on particles in chunks first to last-1, adding up the
+    // contributions of all references.  The rotation matrices have already been
+    // multiplied by the derivatives of the energy with respect to the corresponding
+    // RMSDs.  The forces are first computed as separate arrays of components, then
+    // scattered to the particles.
+
+    const vector<int>& particles = layout->particles;
+    const vector<int>& chunkOffsets = layout->chunkOffsets;
+    int numParticles = particles.size();
+    ParticleArrays<REAL>& arrays = getArrays<REAL>();
+    const ReferenceArrays<REAL>& references = *arrays.references;
+    for (int c = first; c < last; c++) {
+        int k = layout->chunkGroups[c];
+        int start = chunkOffsets[c], count = chunkOffsets[c+1]-start;
+        REAL cx = centers[3*k], cy = centers[3*k+1], cz = centers[3*k+2];
+        REAL* fx = &arrays.forceX[start];
+        REAL* fy = &arrays.forceY[start];
+        REAL* fz = &arrays.forceZ[start];
+        initializeForces(&arrays.posX[start], &arrays.posY[start], &arrays.posZ[start],
+                         count, cx, cy, cz, (REAL) positionScale, fx, fy, fz);
+        for (int m : activeReferences) {
+            int offset = m*numParticles+start;
+            addRotatedReference(&references.refX[offset], &references.refY[offset], &references.refZ[offset],
+                                count, &rotations[9*m], fx, fy, fz);
+        }
+        int firstParticle = layout->chunkFirstParticles[c];
+        if (firstParticle >= 0)
+            for (int j = 0; j < count; j++)
+                forces[firstParticle+j] = Vec3(fx[j], fy[j], fz[j]);
+        else
+            for (int j = 0; j < count; j++)
+                forces[particles[start+j]] = Vec3(fx[j], fy[j], fz[j]);
+    }
+}
+
+void CompositeRMSDForceImpl::getLastQuaternion(int reference, double q[4]) const {
+    // The eigenvector is found again from the key matrix, since it is not computed in
+    // every evaluation.  Its sign is chosen to make the first component non-negative.
+
+    if (reference < 0 || reference >= sumRefPosSq.size())
+        throw OpenMMException("CompositeRMSDForce: Illegal reference index");
+    const double (*F)[4] = reinterpret_cast<const double (*)[4]>(&keyMatrices[16*reference]);
+    double lambda = maxEigenvalues[reference];
+    double upperBound = 0.5*(sumRefPosSq[reference] + sumPosSq);
+    if (!eigenvalueConverged[reference] || !findEigenvector(F, lambda, upperBound, q))
+        findMaxEigenpair(F, lambda, q);
+    if (q[0] < 0)
+        for (int i = 0; i < 4; i++)
+            q[i] = -q[i];
+}
+
+void CompositeRMSDForceImpl::getLastRotation(int reference, double U[3][3]) const {
+    double q[4];
+    getLastQuaternion(reference, q);
+    computeRotationMatrix(q, U);
+}
+
+void CompositeRMSDForceImpl::getLastGroupRMSDs(int reference, vector<double>& rmsds) const {
+    // The squared deviation of group k is (|x|^2 + |y|^2 - 2*tr(U*R))/n, where R is its
+    // correlation matrix with the reference.
+
+    double U[3][3];
+    getLastRotation(reference, U);
+    const vector<int>& groupOffsets = layout->groupOffsets;
+    int numGroups = groupOffsets.size()-1;
+    int numReferences = sumRefPosSq.size();
+    rmsds.resize(numGroups);
+    for (int k = 0; k < numGroups; k++) {
+        const double* sums = &groupSums[(9*numReferences+1)*k];
+        const double* R = &sums[9*reference];
+        double trace = 0.0;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                trace += U[i][j]*R[3*j+i];
+        double msd = (sums[9*numReferences] + groupSumRefPosSq[numReferences*k+reference] - 2*trace)/(groupOffsets[k+1]-groupOffsets[k]);
+        rmsds[k] = (msd > 0.0 ? sqrt(msd) : 0.0);
+    }
+}
+
+void CompositeRMSDForceImpl::computeSecondDerivatives(vector<double>& secondDerivatives) {
+    // The second derivatives of the energy with respect to the RMSDs are only needed for
+    // Hessian-vector products, so they are compiled on first use.  Only the pairs of
+    // RMSDs on which a first derivative depends are differentiated.
+
+    int numReferences = sumRefPosSq.size();
+    if (!secondDerivativesReady) {
+        secondDerivativeExpressions.resize(0);
+        secondDerivativeReferences.resize(0);
+        for (const string& first : energyExpression.getVariables()) {
+            int m1 = findVariable(first, globalParameterNames, numReferences);
+            if (m1 < 0)
+                continue;
+            Lepton::ParsedExpression derivative = parsedEnergy.differentiate(first).optimize();
+            Lepton::CompiledExpression compiled = derivative.createCompiledExpression();
+            for (const string& second : compiled.getVariables()) {
+                int m2 = findVariable(second, globalParameterNames, numReferences);
+                if (m2 >= m1) {
+                    secondDerivativeExpressions.push_back(derivative.differentiate(second).createCompiledExpression());
+                    secondDerivativeReferences.push_back(make_pair(m1, m2));
+                }
+            }
+        }
+        secondDerivativeBindings.resize(0);
+        for (auto& expression : secondDerivativeExpressions)
+            for (const string& name : expression.getVariables())
+                secondDerivativeBindings.push_back(make_pair(&expression.getVariableReference(name), findVariable(name, globalParameterNames, numReferences)));
+        secondDerivativesReady = true;
+    }
+    for (auto& binding : secondDerivativeBindings)
+        *binding.first = (binding.second >= 0 ? rmsds[binding.second] : globalValues[-1-binding.second]);
+    secondDerivatives.assign(numReferences*numReferences, 0.0);
+    for (int i = 0; i < secondDerivativeExpressions.size(); i++) {
+        int m1 = secondDerivativeReferences[i].first, m2 = secondDerivativeReferences[i].second;
+        double value = secondDerivativeExpressions[i].evaluate();
+        secondDerivatives[numReferences*m1+m2] = value;
+        secondDerivatives[numReferences*m2+m1] = value;
+    }
+}
+
+void CompositeRMSDForceImpl::computeHessianTimesVector(const vector<Vec3>& direction, vector<Vec3>& product) {
+    if (direction.size() != layout->systemSize)
+        throw OpenMMException("CompositeRMSDForce: Number of direction vectors does not equal number of particles in the System");
+    if (mixedPrecision)
+        multiplyByHessian<float>(direction, product);
+    else
+        multiplyByHessian<double>(direction, product);
+}
+
+template <class REAL>
+void CompositeRMSDForceImpl::multiplyByHessian(const vector<Vec3>& direction, vector<Vec3>& product) {
+    // The gradient of RMSD d with respect to particle i is w_i/(n*d), where w_i = x_i - U^T*y_i
+    // with x and y the centered positions.  Its derivative along a direction v is
+    //
+    //     (v_i - vc - dU^T*y_i)/(n*d) - w_i*(w.v)/(n^2*d^3),
+    //
+    // where vc is the mean of v over the group of particle i.  The derivative dU of the
+    // rotation is found from the derivative dR = sum_i v_i*y_i^T of the correlation
+    // matrix.  Since the key matrix F is linear in R, first order perturbation theory
+    // gives the derivative of its eigenvector q as the sum over the other eigenpairs
+    // (lambda_j, q_j) of q_j*(q_j^T*dF*q)/(lambda - lambda_j).  U is quadratic in q, so
+    // dU = (U(q+dq) - U(q-dq))/2 exactly.  The chain rule through the energy function adds
+    // the second derivatives of the energy with respect to the RMSDs.  Terms for RMSDs that
+    // are zero and for nearly degenerate eigenvalues are taken as zero.  Like the forces,
+    // the product is computed in two passes split among threads by chunks of particles.
+    // All scratch space is kept in the workspace between calls.
+
+    const vector<int>& particles = layout->particles;
+    const vector<int>& chunkOffsets = layout->chunkOffsets;
+    const vector<int>& chunkGroups = layout->chunkGroups;
+    const vector<int>& groupOffsets = layout->groupOffsets;
+    int numGroups = groupOffsets.size()-1;
+    int numReferences = sumRefPosSq.size();
+    int numParticles = particles.size();
+    int numChunks = chunkGroups.size();
+    ParticleArrays<REAL>& arrays = getArrays<REAL>();
+    const ReferenceArrays<REAL>& references = *arrays.references;
+
+    // For every chunk, add up the directions, their dot products with the centered
+    // positions, and their correlation matrices with all references.
+
+    int sumSize = 9*numReferences+4;
+    vector<double>& sums = hessian.sums;
+    sums.assign(numChunks*sumSize, 0.0);
+    execute(numChunks, [&] (int first, int last, int thread) {
+        for (int c = first; c < last; c++) {
+            int k = chunkGroups[c];
+            double* s = &sums[sumSize*c];
+            for (int j = chunkOffsets[c]; j < chunkOffsets[c+1]; j++) {
+                const Vec3& v = direction[particles[j]];
+                s[0] += v[0];
+                s[1] += v[1];
+                s[2] += v[2];
+                s[3] += v[0]*(arrays.posX[j]-centers[3*k]) + v[1]*(arrays.posY[j]-centers[3*k+1]) + v[2]*(arrays.posZ[j]-centers[3*k+2]);
+            }
+            for (int m = 0; m < numReferences; m++) {
+                double* dR = &s[4+9*m];
+                for (int j = chunkOffsets[c]; j < chunkOffsets[c+1]; j++) {
+                    const Vec3& v = direction[particles[j]];
+                    int offset = m*numParticles+j;
+                    double y[3] = {references.refX[offset], references.refY[offset], references.refZ[offset]};
+                    for (int a = 0; a < 3; a++)
+                        for (int b = 0; b < 3; b++)
+                            dR[3*a+b] += v[a]*y[b];
+                }
+            }
+        }
+    });
+    vector<double>& groupMeans = hessian.groupMeans;
+    vector<double>& totals = hessian.totals;
+    groupMeans.assign(3*numGroups, 0.0);
+    totals.assign(9*numReferences+1, 0.0);
+    for (int c = 0; c < numChunks; c++) {
+        const double* s = &sums[sumSize*c];
+        for (int i = 0; i < 3; i++)
+            groupMeans[3*chunkGroups[c]+i] += s[i];
+        for (int i = 0; i < 9*numReferences+1; i++)
+            totals[i] += s[3+i];
+    }
+    for (int k = 0; k < numGroups; k++)
+        for (int i = 0; i < 3; i++)
+            groupMeans[3*k+i] /= groupOffsets[k+1]-groupOffsets[k];
+
+    // Find the rotation of each reference, its derivative, and the derivative of the RMSD
+    // along the direction.
+
+    vector<double>& U = hessian.rotations;
+    vector<double>& dU = hessian.rotationDerivatives;
+    vector<double>& projections = hessian.projections;
+    U.assign(9*numReferences, 0.0);
+    dU.assign(9*numReferences, 0.0);
+    projections.assign(numReferences, 0.0);
+    Array2D<double>& matrix = hessian.keyMatrix;
+    Array1D<double>& values = hessian.eigenvalues;
+    Array2D<double>& vectors = hessian.eigenvectors;
+    for (int m = 0; m < numReferences; m++) {
+        if (rmsds[m] == 0.0)
+            continue;
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                matrix[i][j] = keyMatrices[16*m+4*i+j];
+        JAMA::Eigenvalue<double> eigen(matrix);
+        eigen.getRealEigenvalues(values);
+        eigen.getV(vectors);
+        double q[4];
+        for (int i = 0; i < 4; i++)
+            q[i] = vectors[i][3];
+        double dF[4][4], dFq[4] = {0};
+        computeKeyMatrix(reinterpret_cast<const double (*)[3]>(&totals[1+9*m]), dF);
+        for (int i = 0; i < 4; i++)
+            for (int j = 0; j < 4; j++)
+                dFq[i] += dF[i][j]*q[j];
+        double upperBound = 0.5*(sumRefPosSq[m] + sumPosSq);
+        double dq[4] = {0};
+        for (int j = 0; j < 3; j++) {
+            double gap = values[3]-values[j];
+            if (gap <= 1e-10*upperBound)
+                continue;
+            double coefficient = 0.0;
+            for (int i = 0; i < 4; i++)
+                coefficient += vectors[i][j]*dFq[i];
+            coefficient /= gap;
+            for (int i = 0; i < 4; i++)
+                dq[i] += coefficient*vectors[i][j];
+        }
+        double plus[4], minus[4], Uplus[3][3], Uminus[3][3];
+        for (int i = 0; i < 4; i++) {
+            plus[i] = q[i]+dq[i];
+            minus[i] = q[i]-dq[i];
+        }
+        double (*rotation)[3] = reinterpret_cast<double (*)[3]>(&U[9*m]);
+        computeRotationMatrix(q, rotation);
+        computeRotationMatrix(plus, Uplus);
+        computeRotationMatrix(minus, Uminus);
+        const double* dR = &totals[1+9*m];
+        double trace = 0.0;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) {
+                dU[9*m+3*i+j] = 0.5*(Uplus[i][j]-Uminus[i][j]);
+                trace += rotation[i][j]*dR[3*j+i];
+            }
+        projections[m] = (totals[0]-trace)/(numParticles*rmsds[m]);
+    }
+
+    // Combine the contributions of all references into a coefficient of the centered
+    // directions, a coefficient of the centered positions, and a matrix that multiplies
+    // the reference positions.
+
+    vector<double>& secondDerivatives = hessian.secondDerivatives;
+    computeSecondDerivatives(secondDerivatives);
+    double directionScale = 0.0, deviationScale = 0.0;
+    vector<double>& matrices = hessian.matrices;
+    vector<int>& contributing = hessian.contributing;
+    matrices.assign(9*numReferences, 0.0);
+    contributing.resize(0);
+    for (int m = 0; m < numReferences; m++) {
+        if (rmsds[m] == 0.0)
+            continue;
+        double alpha = energyDerivatives[m]/(numParticles*rmsds[m]);
+        double beta = -energyDerivatives[m]*projections[m]/rmsds[m];
+        for (int m2 = 0; m2 < numReferences; m2++)
+            beta += secondDerivatives[numReferences*m+m2]*projections[m2];
+        double gamma = beta/(numParticles*rmsds[m]);
+        directionScale += alpha;
+        deviationScale += gamma;
+        for (int i = 0; i < 9; i++)
+            matrices[9*m+i] = alpha*dU[9*m+i] + gamma*U[9*m+i];
+        contributing.push_back(m);
+    }
+
+    // Compute the product for every particle in a group.
+
+    product.assign(layout->systemSize, Vec3(0, 0, 0));
+    execute(numChunks, [&] (int first, int last, int thread) {
+        for (int c = first; c < last; c++) {
+            int k = chunkGroups[c];
+            Vec3 mean(groupMeans[3*k], groupMeans[3*k+1], groupMeans[3*k+2]);
+            Vec3 center(centers[3*k], centers[3*k+1], centers[3*k+2]);
+            for (int j = chunkOffsets[c]; j < chunkOffsets[c+1]; j++) {
+                int i = particles[j];
+                Vec3 x = Vec3(arrays.posX[j], arrays.posY[j], arrays.posZ[j]) - center;
+                Vec3 p = (direction[i]-mean)*directionScale + x*deviationScale;
+                for (int m : contributing) {
+                    int offset = m*numParticles+j;
+                    Vec3 y(references.refX[offset], references.refY[offset], references.refZ[offset]);
+                    const double* M = &matrices[9*m];
+                    for (int a = 0; a < 3; a++)
+                        p[a] -= M[a]*y[0] + M[3+a]*y[1] + M[6+a]*y[2];
+                }
+                product[i] = p;
+            }
+        }
+    });
+}
+
+void CompositeRMSDForceImpl::computeBatch(const CompositeRMSDForce& force, const double* frames, int numFrames, int numParticles,
+                                          double* energies, double* rmsds, double* gradients) {
+    // Frames are split among threads in contiguous blocks.  Each thread evaluates its
+    // frames serially with its own working arrays, which share the layout and references
+    // with those of the other threads.  Warm starts are disabled, so the result for a
+    // frame does not depend on which frames were evaluated before it.  Coordinates are
+    // read in place, so that only the particles in groups are touched.
+
+    static_assert(sizeof(Vec3) == 3*sizeof(double), "Vec3 must consist of three packed doubles");
+    if (numFrames < 0 || numParticles < 0)
+        throw OpenMMException("CompositeRMSDForce: Illegal number of frames or particles");
+    unique_ptr<ThreadPool> pool;
+    if (force.getNumThreads() != 1)
+        pool.reset(new ThreadPool(force.getNumThreads()));
+    int numWorkers = (pool == NULL ? 1 : min(pool->getNumThreads(), max(numFrames, 1)));
+    vector<unique_ptr<CompositeRMSDForceImpl> > workers(numWorkers);
+    for (auto& worker : workers) {
+        worker.reset(new CompositeRMSDForceImpl(force));
+        worker->serial = true;
+        worker->updateParameters(numParticles);
+        worker->useWarmStart = false;
+        worker->forcesRequested = (gradients != NULL);
+        for (int i = 0; i < worker->globalParameterNames.size(); i++)
+            worker->globalValues[i] = force.getGlobalParameterDefaultValue(i);
+    }
+    int numReferences = force.getNumReferences();
+    auto task = [&] (int worker) {
+        CompositeRMSDForceImpl& impl = *workers[worker];
+        vector<Vec3> forces(numParticles);
+        int first = (int) ((long long) worker*numFrames/numWorkers);
+        int last = (int) ((long long) (worker+1)*numFrames/numWorkers);
+        for (int f = first; f < last; f++) {
+            const Vec3* positions = reinterpret_cast<const Vec3*>(frames+3LL*numParticles*f);
+            energies[f] = impl.evaluate(positions, forces);
+            if (rmsds != NULL)
+                copy(impl.rmsds.begin(), impl.rmsds.end(), rmsds+(long long) numReferences*f);
+            if (gradients != NULL) {
+                double* gradient = gradients+3LL*numParticles*f;
+                for (int i = 0; i < numParticles; i++)
+                    for (int j = 0; j < 3; j++)
+                        gradient[3*i+j] = -forces[i][j];
+            }
+        }
+    };
+    if (numWorkers == 1)
+        task(0);
+    else {
+        pool->execute([&] (ThreadPool& pool, int thread) {
+            if (thread < numWorkers)
+                task(thread);
+        });
+        pool->waitForThreads();
+    }
+}
+
+void CompositeRMSDForceImpl::getProfile(map<string, double>& values) const {
+    values.clear();
+    values["evaluations"] = profile.evaluations;
+    values["cacheHits"] = profile.cacheHits;
+    values["energyOnly"] = profile.energyOnly;
+    values["zeroRMSDs"] = profile.zeroRMSDs;
+    values["warmStartFallbacks"] = profile.warmStartFallbacks;
+    values["solverFallbacks"] = profile.solverFallbacks;
+    values["gatherTime"] = profile.gatherTime;
+    values["correlationTime"] = profile.correlationTime;
+    values["eigenTime"] = profile.eigenTime;
+    values["forceTime"] = profile.forceTime;
+    values["numThreads"] = numThreads;
+}
+
+void CompositeRMSDForceImpl::resetProfile() {
+    profile = Profile();
 }
 
 void CompositeRMSDForceImpl::updateParametersInContext(ContextImpl& context) {
@@ -29,5 +29,193 @@ int isNumpyAvailable() {
     return available;
 }
 
+/*
+Return a new reference to a length in nanometers if it is a Quantity, or to the object
+itself otherwise.
+*/
+PyObject* stripLengthUnits(PyObject* obj) {
+    if (!PyObject_HasAttrString(obj, "value_in_unit")) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    PyObject* unitModule = PyImport_ImportModule("openmm.unit");
+    if (unitModule == NULL)
+        return NULL;
+    PyObject* nanometers = PyObject_GetAttrString(unitModule, "nanometers");
+    Py_DECREF(unitModule);
+    if (nanometers == NULL)
+        return NULL;
+    PyObject* value = PyObject_CallMethod(obj, "value_in_unit", "O", nanometers);
+    Py_DECREF(nanometers);
+    return value;
+}
+
+/*
+Copy a sequence of positions into a vector of Vec3.  Anything NumPy can view as a
+float64 array of shape (N, 3), such as an array or a list of Vec3, is copied with a
+single memcpy.  Sequences whose items carry their own units are converted item by item.
+Returns 0 and sets a Python exception on failure.
+*/
+int copyToVec3Vector(PyObject* obj, std::vector<Vec3>& result) {
+    static_assert(sizeof(Vec3) == 3*sizeof(double), "Vec3 must be three packed doubles");
+    if (!isNumpyAvailable()) {
+        PyErr_SetString(PyExc_ImportError, "NumPy is required to convert positions");
+        return 0;
+    }
+    PyObject* value = stripLengthUnits(obj);
+    if (value == NULL)
+        return 0;
+    PyArrayObject* array = (PyArrayObject*) PyArray_FROMANY(value, NPY_DOUBLE, 1, 2, NPY_ARRAY_IN_ARRAY);
+    if (array != NULL) {
+        Py_DECREF(value);
+        npy_intp size = PyArray_SIZE(array);
+        if (size > 0 && (PyArray_NDIM(array) != 2 || PyArray_DIM(array, 1) != 3)) {
+            Py_DECREF(array);
+            PyErr_SetString(PyExc_ValueError, "Positions must have shape (N, 3)");
+            return 0;
+        }
+        result.resize(size/3);
+        if (size > 0)
+            memcpy(&result[0], PyArray_DATA(array), size*sizeof(double));
+        Py_DECREF(array);
+        return 1;
+    }
+    PyErr_Clear();
+    PyObject* sequence = PySequence_Fast(value, "Positions must be a sequence");
+    Py_DECREF(value);
+    if (sequence == NULL)
+        return 0;
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(sequence);
+    result.resize(n);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject* item = stripLengthUnits(PySequence_Fast_GET_ITEM(sequence, i));
+        if (item == NULL) {
+            Py_DECREF(sequence);
+            return 0;
+        }
+        PyArrayObject* vec = (PyArrayObject*) PyArray_FROMANY(item, NPY_DOUBLE, 1, 1, NPY_ARRAY_IN_ARRAY);
+        Py_DECREF(item);
+        if (vec == NULL || PyArray_SIZE(vec) != 3) {
+            Py_XDECREF(vec);
+            Py_DECREF(sequence);
+            PyErr_SetString(PyExc_ValueError, "Each position must have three components");
+            return 0;
+        }
+        const double* data = (const double*) PyArray_DATA(vec);
+        result[i] = Vec3(data[0], data[1], data[2]);
+        Py_DECREF(vec);
+    }
+    Py_DECREF(sequence);
+    return 1;
+}
+
+/*
+Copy the integers of an array of type T into a vector of int of the same size.  Returns 0
+and sets a Python exception if a value does not fit in an int.
+*/
+template <class T>
+int copyCheckedIntegers(PyArrayObject* array, std::vector<int>& result) {
+    const T* data = (const T*) PyArray_DATA(array);
+    for (size_t i = 0; i < result.size(); i++) {
+        bool isSigned = ((T) -1 < (T) 0);
+        if (data[i] > (T) INT_MAX || (isSigned && (long long) data[i] < INT_MIN)) {
+            PyErr_SetString(PyExc_OverflowError, "Particle index does not fit in a 32-bit integer");
+            return 0;
+        }
+        result[i] = (int) data[i];
+    }
+    return 1;
+}
+
+/*
+Copy a sequence of integers, such as a list or an integer array of any width, into a
+vector of int.  Arrays whose type converts to int32 without loss are copied with a single
+memcpy.  Wider types are checked element by element, so that values are never truncated
+or wrapped around.  Returns 0 and sets a Python exception on failure.
+*/
+int copyToIntVector(PyObject* obj, std::vector<int>& result) {
+    if (!isNumpyAvailable()) {
+        PyErr_SetString(PyExc_ImportError, "NumPy is required to convert indices");
+        return 0;
+    }
+    PyArrayObject* input = (PyArrayObject*) PyArray_FromAny(obj, NULL, 1, 1, NPY_ARRAY_IN_ARRAY, NULL);
+    if (input == NULL)
+        return 0;
+    npy_intp size = PyArray_SIZE(input);
+    if (size > 0 && !PyArray_ISINTEGER(input)) {
+        Py_DECREF(input);
+        PyErr_SetString(PyExc_TypeError, "Particle indices must be integers");
+        return 0;
+    }
+    bool safe = (size == 0 || PyArray_CanCastSafely(PyArray_TYPE(input), NPY_INT));
+    bool isUnsigned = (size > 0 && PyArray_ISUNSIGNED(input));
+    int type = (safe ? NPY_INT : isUnsigned ? NPY_ULONGLONG : NPY_LONGLONG);
+    PyArrayObject* array = (PyArrayObject*) PyArray_FROMANY((PyObject*) input, type, 1, 1, NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+    Py_DECREF(input);
+    if (array == NULL)
+        return 0;
+    result.resize(size);
+    int success = 1;
+    if (safe && size > 0)
+        memcpy(&result[0], PyArray_DATA(array), size*sizeof(int));
+    else if (!safe && isUnsigned)
+        success = copyCheckedIntegers<unsigned long long>(array, result);
+    else if (!safe)
+        success = copyCheckedIntegers<long long>(array, result);
+    Py_DECREF(array);
+    return success;
+}
+
+/*
+Create a float64 NumPy array of shape (N, 3) from a vector of Vec3 with a single memcpy.
+*/
+PyObject* copyVec3VectorToArray(const std::vector<Vec3>& positions) {
+    if (!isNumpyAvailable()) {
+        PyErr_SetString(PyExc_ImportError, "NumPy is not available");
+        return NULL;
+    }
+    npy_intp dims[2] = {(npy_intp) positions.size(), 3};
+    PyObject* array = PyArray_SimpleNew(2, dims, NPY_DOUBLE);
+    if (array != NULL && positions.size() > 0)
+        memcpy(PyArray_DATA((PyArrayObject*) array), &positions[0], positions.size()*sizeof(Vec3));
+    return array;
+}
+
+/*
+Create an int32 NumPy array from a vector of int with a single memcpy.
+*/
+PyObject* copyIntVectorToArray(const std::vector<int>& values) {
+    if (!isNumpyAvailable()) {
+        PyErr_SetString(PyExc_ImportError, "NumPy is not available");
+        return NULL;
+    }
+    npy_intp dims[1] = {(npy_intp) values.size()};
+    PyObject* array = PyArray_SimpleNew(1, dims, NPY_INT);
+    if (array != NULL && values.size() > 0)
+        memcpy(PyArray_DATA((PyArrayObject*) array), &values[0], values.size()*sizeof(int));
+    return array;
+}
+
+/*
+Get the data of an output array, which must be a writable, aligned, C-contiguous float64
+NumPy array of the given shape, since results written to a converted copy would be lost.
+Returns NULL and sets a Python exception otherwise.
+*/
+double* getOutputArrayData(PyObject* obj, int ndim, const npy_intp* dims) {
+    if (!PyArray_Check(obj) || PyArray_TYPE((PyArrayObject*) obj) != NPY_DOUBLE || !PyArray_ISCARRAY((PyArrayObject*) obj)) {
+        PyErr_SetString(PyExc_TypeError, "Output arrays must be writable C-contiguous float64 arrays");
+        return NULL;
+    }
+    PyArrayObject* array = (PyArrayObject*) obj;
+    bool matches = (PyArray_NDIM(array) == ndim);
+    for (int i = 0; i < ndim && matches; i++)
+        matches = (PyArray_DIM(array, i) == dims[i]);
+    if (!matches) {
+        PyErr_SetString(PyExc_ValueError, "Output array has the wrong shape");
+        return NULL;
+    }
+    return (double*) PyArray_DATA(array);
+}
+
 } // namespace OpenMM
 %}
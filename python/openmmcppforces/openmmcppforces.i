@@ -19,13 +19,16 @@ using namespace OpenMM;
 %import(module="openmm") "swig/OpenMMSwigHeaders.i"
 %include "swig/typemaps.i"
 %include "header.i"
+%include "std_string.i"
 %include "std_vector.i"
 
 namespace std {
   %template(vectori) vector<int>;
+  %template(vectord) vector<double>;
 };
 
 %pythoncode %{
+import numpy as np
 from openmm import unit
 %}
 
@@ -37,6 +40,51 @@ Add units to function outputs.
     val *= unit.nanometers
 %}
 
+%pythonappend OpenMMCPPForces::CompositeRMSDForce::getReferencePositions(int index) const %{
+    val *= unit.nanometers
+%}
+
+%pythonappend OpenMMCPPForces::CompositeRMSDForce::getGroupReferencePositions(int group, int reference) const %{
+    val *= unit.nanometers
+%}
+
+/*
+Convert positions and particle indices through NumPy buffers, so that arrays of shape
+(N, 3) and integer arrays are copied with a single memcpy.
+*/
+
+%typemap(in) const std::vector<Vec3>& positions (std::vector<Vec3> temp),
+             const std::vector<Vec3>& referencePositions (std::vector<Vec3> temp),
+             const std::vector<Vec3>& direction (std::vector<Vec3> temp) {
+    if (!OpenMM::copyToVec3Vector($input, temp))
+        SWIG_fail;
+    $1 = &temp;
+}
+
+%typemap(typecheck, precedence=SWIG_TYPECHECK_POINTER) const std::vector<Vec3>& positions,
+                                                       const std::vector<Vec3>& referencePositions,
+                                                       const std::vector<Vec3>& direction {
+    $1 = (PySequence_Check($input) || PyObject_HasAttrString($input, "value_in_unit")) ? 1 : 0;
+}
+
+%typemap(in) const std::vector<int>& particles (std::vector<int> temp) {
+    if (!OpenMM::copyToIntVector($input, temp))
+        SWIG_fail;
+    $1 = &temp;
+}
+
+%typemap(typecheck, precedence=SWIG_TYPECHECK_POINTER) const std::vector<int>& particles {
+    $1 = PySequence_Check($input) ? 1 : 0;
+}
+
+/*
+Getters that can also return NumPy arrays are wrapped in Python below.
+*/
+
+%rename(_getReferencePositions) OpenMMCPPForces::CompositeRMSDForce::getReferencePositions;
+%rename(_getGroup) OpenMMCPPForces::CompositeRMSDForce::getGroup;
+%rename(_getGroupReferencePositions) OpenMMCPPForces::CompositeRMSDForce::getGroupReferencePositions;
+
 /*
 Convert C++ exceptions to Python exceptions.
 */
@@ -92,6 +140,29 @@ thus keeping their relative orientations fixed.
 
 This force is intended for use with :OpenMM:`CustomCVForce`.
 
+Additional reference structures can be added with :func:`addReferencePositions`. The
+composite RMSDs with respect to all of them are computed in a single pass over the
+particles, and the energy is given by an algebraic expression of these RMSDs, specified
+with :func:`setEnergyFunction`. The RMSD with respect to reference `k` is the variable
+`rmsdk` in this expression, that is, `rmsd0`, `rmsd1`, and so on. By default, the
+energy is simply `rmsd0`. The expression may also depend on global parameters, defined
+with :func:`addGlobalParameter`. Several restraints that share the same groups, such as
+the windows of an umbrella sampling simulation, can thus be combined into a single
+force, so that positions are gathered and forces are scattered only once.
+
+This force is platform-agnostic: it is always computed on the CPU, even when the
+:OpenMM:`Context` uses a GPU platform. In that case, positions are copied to the host
+and forces are copied back to the device at every evaluation. The GPU platforms run
+the host computation in a worker thread while the kernels of other forces execute, so
+its cost is hidden as long as it takes less time than them. For large particle groups,
+the host computation can be accelerated with :func:`setNumThreads`.
+
+Positions may be given as lists of Vec3 or as NumPy arrays of shape (N, 3), with or
+without units, and particle indices as lists or integer NumPy arrays. Arrays are copied
+into the force with a single memcpy. The getters of positions and particle indices
+accept ``asNumpy=True`` to return NumPy arrays in the same way, which is much faster
+than building lists when references are updated frequently from Python.
+
 Parameters
 ----------
 referencePositions
@@ -133,13 +204,11 @@ class CompositeRMSDForce : public OpenMM::Force {
 public:
     explicit CompositeRMSDForce(const std::vector<Vec3>& referencePositions);
 
-    %feature("docstring") %{
-    Get the reference positions to compute the deviation from.
-    %}
     const std::vector<Vec3>& getReferencePositions() const;
 
     %feature("docstring") %{
-    Set the reference positions to compute the deviation from.
+    Set the reference positions to compute the deviation from. This is the same as
+    ``setReferencePositions(0, positions)``.
 
     Parameters
     ----------
@@ -150,6 +219,128 @@ public:
     %}
     void setReferencePositions(const std::vector<Vec3>& positions);
 
+    %feature("docstring") %{
+    Add a reference structure to compute a deviation from.
+
+    Parameters
+    ----------
+    positions
+        the reference positions to compute the deviation from. The length of this
+        vector must equal the number of particles in the system.
+
+    Returns
+    -------
+    int
+        the index of the reference that was added
+    %}
+    int addReferencePositions(const std::vector<Vec3>& positions);
+
+    %feature("docstring") %{
+    Get the number of reference structures, including the one passed to the
+    constructor.
+    %}
+    int getNumReferences() const;
+
+    const std::vector<Vec3>& getReferencePositions(int index) const;
+
+    %feature("docstring") %{
+    Set the positions of a reference structure.
+
+    Parameters
+    ----------
+    index
+        the index of the reference whose positions are to be set
+    positions
+        the reference positions to compute the deviation from. The length of this
+        vector must equal the number of particles in the system.
+    %}
+    void setReferencePositions(int index, const std::vector<Vec3>& positions);
+
+    %feature("docstring") %{
+    Get the algebraic expression that gives the energy as a function of the RMSDs
+    with respect to the reference structures.
+    %}
+    const std::string& getEnergyFunction() const;
+
+    %feature("docstring") %{
+    Set the algebraic expression that gives the energy as a function of the RMSDs
+    with respect to the reference structures. The RMSD with respect to reference `k`
+    is the variable `rmsdk`. The default is `rmsd0`.
+
+    Parameters
+    ----------
+    energy
+        the energy expression
+    %}
+    void setEnergyFunction(const std::string& energy);
+
+    %feature("docstring") %{
+    Get the number of global parameters that the energy depends on.
+    %}
+    int getNumGlobalParameters() const;
+
+    %feature("docstring") %{
+    Add a new global parameter that the energy may depend on. The default value
+    provided here is used when the :OpenMM:`Context` is created.
+
+    Parameters
+    ----------
+    name
+        the name of the parameter
+    defaultValue
+        the default value of the parameter
+
+    Returns
+    -------
+    int
+        the index of the parameter that was added
+    %}
+    int addGlobalParameter(const std::string& name, double defaultValue);
+
+    %feature("docstring") %{
+    Get the name of a global parameter.
+
+    Parameters
+    ----------
+    index
+        the index of the parameter for which to get the name
+    %}
+    const std::string& getGlobalParameterName(int index) const;
+
+    %feature("docstring") %{
+    Set the name of a global parameter.
+
+    Parameters
+    ----------
+    index
+        the index of the parameter for which to set the name
+    name
+        the name of the parameter
+    %}
+    void setGlobalParameterName(int index, const std::string& name);
+
+    %feature("docstring") %{
+    Get the default value of a global parameter.
+
+    Parameters
+    ----------
+    index
+        the index of the parameter for which to get the default value
+    %}
+    double getGlobalParameterDefaultValue(int index) const;
+
+    %feature("docstring") %{
+    Set the default value of a global parameter.
+
+    Parameters
+    ----------
+    index
+        the index of the parameter for which to set the default value
+    defaultValue
+        the default value of the parameter
+    %}
+    void setGlobalParameterDefaultValue(int index, double defaultValue);
+
     %feature("docstring") %{
     Add a group of particles to make part of the composite RMSD calculation.
 
@@ -166,23 +357,48 @@ public:
     int addGroup(const std::vector<int>& particles);
 
     %feature("docstring") %{
-    Get the number of particle groups included in the composite RMSD calculation.
+    Add a group formed by a range of consecutive particles. This avoids storing the
+    index of every particle in large groups.
+
+    Parameters
+    ----------
+    first
+        the index of the first particle in the group
+    last
+        the index one past the last particle in the group
+
+    Returns
+    -------
+    int
+        the index of the group that was added
     %}
-    int getNumGroups() const;
+    int addGroupRange(int first, int last);
 
     %feature("docstring") %{
-    Get the particles of a group included in the composite RMSD calculation.
+    Add a group of particles along with their positions in the first reference
+    structure. This is the same as calling :func:`addGroup` followed by
+    :func:`setGroupReferencePositions` with reference index 0.
 
     Parameters
     ----------
-    index
-        the index of the group whose particles are to be retrieved
+    particles
+        the indices of the particles to include
+    referencePositions
+        the positions of these particles in the first reference structure, in the
+        same order
 
     Returns
     -------
-    List[int]
-        the indices of the particles in the group
+    int
+        the index of the group that was added
     %}
+    int addGroup(const std::vector<int>& particles, const std::vector<Vec3>& referencePositions);
+
+    %feature("docstring") %{
+    Get the number of particle groups included in the composite RMSD calculation.
+    %}
+    int getNumGroups() const;
+
     const std::vector<int>& getGroup(int index) const;
 
     %feature("docstring") %{
@@ -198,15 +414,216 @@ public:
     void setGroup(int index, const std::vector<int>& particles);
 
     %feature("docstring") %{
-    Update the reference positions and particle groups in a Context to match those
-    stored in this OpenMM::`Force` object. This method provides an efficient way to
-    update these parameters in an existing :OpenMM:`Context` without needing to
-    reinitialize it. Simply call :func:`setReferencePositions` and :func:`setGroup` to
+    Get whether a group is a range of consecutive particles.
+
+    Parameters
+    ----------
+    index
+        the index of the group
+    %}
+    bool getGroupIsRange(int index) const;
+
+    %feature("docstring") %{
+    Get the range of particles of a group added with :func:`addGroupRange` or modified
+    with :func:`setGroupRange`.
+
+    Parameters
+    ----------
+    index
+        the index of the group whose range is to be retrieved
+
+    Returns
+    -------
+    Tuple[int, int]
+        the index of the first particle in the group and the index one past the last
+    %}
+    %apply int& OUTPUT {int& first};
+    %apply int& OUTPUT {int& last};
+    void getGroupRange(int index, int& first, int& last) const;
+    %clear int& first;
+    %clear int& last;
+
+    %feature("docstring") %{
+    Set a group to be a range of consecutive particles.
+
+    Parameters
+    ----------
+    index
+        the index of the group to modify
+    first
+        the index of the first particle in the group
+    last
+        the index one past the last particle in the group
+    %}
+    void setGroupRange(int index, int first, int last);
+
+    const std::vector<Vec3>& getGroupReferencePositions(int group, int reference) const;
+
+    %feature("docstring") %{
+    Set the positions of the particles of a group in a reference structure. These
+    replace the positions of the same particles in the full reference structure, so
+    that reference positions only need to be stored for particles in groups.
+
+    Parameters
+    ----------
+    group
+        the index of the group
+    reference
+        the index of the reference structure
+    positions
+        the reference positions of the particles in the group, in the same order as the
+        particles, or an empty list to use the full reference structure. For a range of
+        particles, or for a group containing all particles, they are in order of
+        increasing index.
+    %}
+    void setGroupReferencePositions(int group, int reference, const std::vector<Vec3>& positions);
+
+    %feature("docstring") %{
+    Update the reference positions, particle groups, and energy function in a Context
+    to match those stored in this OpenMM::`Force` object. This method provides an
+    efficient way to update these parameters in an existing :OpenMM:`Context` without
+    needing to reinitialize it. Simply call :func:`setReferencePositions` and :func:`setGroup` to
     modify this object's parameters, then call :func:`updateParametersInContext` to
-    copy them over to the :OpenMM:`Context`.
+    copy them over to the :OpenMM:`Context`. If the new parameters are invalid, an
+    exception is raised and the :OpenMM:`Context` keeps using the previous ones.
     %}
     void updateParametersInContext(OpenMM::Context& context);
 
+    %feature("docstring") %{
+    Get the number of threads used to compute this force. A value of 0 means that as
+    many threads as there are processors are used.
+    %}
+    int getNumThreads() const;
+
+    %feature("docstring") %{
+    Set the number of threads used to compute this force. By default, the force is
+    computed in a single thread. Using multiple threads is only worthwhile for large
+    particle groups. A change only takes effect in existing :OpenMM:`Context` objects
+    after :func:`updateParametersInContext` is called.
+
+    Parameters
+    ----------
+    threads
+        the number of threads to use, or 0 to use as many threads as there are
+        processors
+    %}
+    void setNumThreads(int threads);
+
+    %feature("docstring") %{
+    Get whether the optimal rotation is searched for starting from the one found in
+    the previous evaluation.
+    %}
+    bool getUseWarmStart() const;
+
+    %feature("docstring") %{
+    Set whether the optimal rotation is searched for starting from the one found in
+    the previous evaluation. This saves a few iterations when the positions change
+    little between evaluations, as in molecular dynamics. If the warm start fails to
+    converge, the search is restarted from scratch. This is disabled by default. A
+    change only takes effect in existing :OpenMM:`Context` objects after
+    :func:`updateParametersInContext` is called.
+
+    Parameters
+    ----------
+    use
+        whether to use warm starts
+    %}
+    void setUseWarmStart(bool use);
+
+    %feature("docstring") %{
+    Get the relative tolerance for convergence of the largest eigenvalue of the
+    quaternion key matrix, which determines the optimal rotation.
+    %}
+    double getAlignmentTolerance() const;
+
+    %feature("docstring") %{
+    Set the relative tolerance for convergence of the largest eigenvalue of the
+    quaternion key matrix, which determines the optimal rotation. The default value
+    is 1e-14. A change only takes effect in existing :OpenMM:`Context` objects after
+    :func:`updateParametersInContext` is called.
+
+    Parameters
+    ----------
+    tolerance
+        the relative tolerance, which must be positive
+    %}
+    void setAlignmentTolerance(double tolerance);
+
+    %feature("docstring") %{
+    Get whether positions and forces are stored and processed in single precision,
+    with sums accumulated in double precision.
+    %}
+    bool getUseMixedPrecision() const;
+
+    %feature("docstring") %{
+    Set whether positions and forces are stored and processed in single precision,
+    with the correlation matrices and sums of squares accumulated in double precision.
+    This halves the memory traffic for large groups, at the cost of relative errors of
+    about 1e-6 in the RMSD and 1e-5 in the forces. This is disabled by default. A change
+    only takes effect in existing :OpenMM:`Context` objects after
+    :func:`updateParametersInContext` is called.
+
+    Parameters
+    ----------
+    use
+        whether to use mixed precision
+    %}
+    void setUseMixedPrecision(bool use);
+
+    %feature("docstring") %{
+    Get whether the number of threads is chosen automatically when a
+    :OpenMM:`Context` is created.
+    %}
+    bool getUseAutotuning() const;
+
+    %feature("docstring") %{
+    Set whether the number of threads is chosen automatically when a
+    :OpenMM:`Context` is created. If enabled, the passes over the particles are timed
+    on the actual groups with 1, 2, 4, ... threads, up to the number set with
+    :func:`setNumThreads`, and the fastest choice is kept. This takes a few
+    milliseconds per candidate and is repeated only when the groups or the settings
+    that affect the timings change. The number of threads chosen is reported by
+    :func:`getProfile`. This is disabled by default, in which case exactly the number
+    of threads set with :func:`setNumThreads` is used. A change only takes effect in
+    existing Contexts after :func:`updateParametersInContext` is called.
+
+    Parameters
+    ----------
+    use
+        whether to choose the number of threads automatically
+    %}
+    void setUseAutotuning(bool use);
+
+    %feature("docstring") %{
+    Get whether the time spent in each phase of the computation and the number of
+    certain events are recorded in every :OpenMM:`Context`.
+    %}
+    bool getUseProfiling() const;
+
+    %feature("docstring") %{
+    Set whether the time spent in each phase of the computation and the number of
+    certain events are recorded in every :OpenMM:`Context`, to be retrieved with
+    :func:`getProfile`. The overhead is a few clock readings per evaluation. This is
+    disabled by default. A change only takes effect in existing Contexts after
+    :func:`updateParametersInContext` is called.
+
+    Parameters
+    ----------
+    use
+        whether to record the profile
+    %}
+    void setUseProfiling(bool use);
+
+    %feature("docstring") %{
+    Reset all entries of the profile recorded in a :OpenMM:`Context` to zero.
+
+    Parameters
+    ----------
+    context
+        the :OpenMM:`Context` whose profile is to be reset
+    %}
+    void resetProfile(OpenMM::Context& context);
+
     %feature("docstring") %{
     Returns whether or not this force makes use of periodic boundary
     conditions.
@@ -220,6 +637,312 @@ public:
 
 
     %extend {
+        %feature("docstring") %{
+        Get the RMSD of each group with respect to a reference structure in a
+        :OpenMM:`Context`. All groups are first aligned with the same optimal rotation
+        used to compute the composite RMSD, so these values show which groups deviate
+        the most. This force alone is evaluated, without computing the other forces in
+        the Context, if the positions or global parameters have changed since the last
+        evaluation.
+
+        Parameters
+        ----------
+        context
+            the :OpenMM:`Context` for which to get the values
+        reference
+            the index of the reference structure
+
+        Returns
+        -------
+        List[float]
+            the RMSD of each group, in nanometers
+        %}
+        std::vector<double> getGroupRMSDs(OpenMM::Context& context, int reference=0) {
+            std::vector<double> rmsds;
+            self->getGroupRMSDs(context, rmsds, reference);
+            return rmsds;
+        }
+
+        %feature("docstring") %{
+        Get the optimal rotation with respect to a reference structure in a
+        :OpenMM:`Context`, as a unit quaternion (w, x, y, z) with a non-negative first
+        component. The corresponding rotation matrix aligns the centered positions of
+        all groups to the centered reference. As in :func:`getGroupRMSDs`, this force
+        alone is evaluated if the positions or global parameters have changed since the
+        last evaluation.
+
+        Parameters
+        ----------
+        context
+            the :OpenMM:`Context` for which to get the rotation
+        reference
+            the index of the reference structure
+
+        Returns
+        -------
+        List[float]
+            the four components of the quaternion
+        %}
+        std::vector<double> getOptimalRotation(OpenMM::Context& context, int reference=0) {
+            std::vector<double> quaternion;
+            self->getOptimalRotation(context, quaternion, reference);
+            return quaternion;
+        }
+
+        PyObject* _computeHessianTimesVector(OpenMM::Context& context, const std::vector<Vec3>& direction) {
+            std::vector<Vec3> product;
+            self->computeHessianTimesVector(context, direction, product);
+            return OpenMM::copyVec3VectorToArray(product);
+        }
+
+        PyObject* _getReferencePositionsArray(int index) const {
+            return OpenMM::copyVec3VectorToArray(self->getReferencePositions(index));
+        }
+
+        PyObject* _getGroupArray(int index) const {
+            return OpenMM::copyIntVectorToArray(self->getGroup(index));
+        }
+
+        PyObject* _getGroupReferencePositionsArray(int group, int reference) const {
+            return OpenMM::copyVec3VectorToArray(self->getGroupReferencePositions(group, reference));
+        }
+
+        PyObject* _computeBatch(PyObject* frames, PyObject* energies, PyObject* rmsds, PyObject* gradients) const {
+            // The frames are read in place if they already are a C-contiguous float64
+            // array, and converted otherwise.  The results are written in place, so the
+            // output arrays must have exactly the expected type, layout and shape.
+
+            if (!OpenMM::isNumpyAvailable()) {
+                PyErr_SetString(PyExc_ImportError, "NumPy is required to compute a batch");
+                return NULL;
+            }
+            PyArrayObject* array = (PyArrayObject*) PyArray_FROMANY(frames, NPY_DOUBLE, 3, 3, NPY_ARRAY_IN_ARRAY);
+            if (array == NULL)
+                return NULL;
+            npy_intp numFrames = PyArray_DIM(array, 0), numParticles = PyArray_DIM(array, 1);
+            if (PyArray_DIM(array, 2) != 3 || numFrames > INT_MAX || numParticles > INT_MAX) {
+                Py_DECREF(array);
+                PyErr_SetString(PyExc_ValueError, "Frames must have shape (F, N, 3)");
+                return NULL;
+            }
+            npy_intp energyShape[] = {numFrames};
+            npy_intp rmsdShape[] = {numFrames, self->getNumReferences()};
+            double* energyData = OpenMM::getOutputArrayData(energies, 1, energyShape);
+            double* rmsdData = NULL;
+            double* gradientData = NULL;
+            bool valid = (energyData != NULL);
+            if (valid && rmsds != Py_None)
+                valid = ((rmsdData = OpenMM::getOutputArrayData(rmsds, 2, rmsdShape)) != NULL);
+            if (valid && gradients != Py_None)
+                valid = ((gradientData = OpenMM::getOutputArrayData(gradients, 3, PyArray_DIMS(array))) != NULL);
+            if (!valid) {
+                Py_DECREF(array);
+                return NULL;
+            }
+            try {
+                self->computeBatch((const double*) PyArray_DATA(array), numFrames, numParticles, energyData, rmsdData, gradientData);
+            }
+            catch (...) {
+                Py_DECREF(array);
+                throw;
+            }
+            Py_DECREF(array);
+            Py_RETURN_NONE;
+        }
+
+        %pythoncode %{
+        def computeBatch(self, frames, getRMSDs=False, getGradients=False, blockSize=1024):
+            """
+            Compute the energy of this force for a batch of frames, such as those of a
+            stored trajectory, without creating a :OpenMM:`Context`. The frames are
+            evaluated with the same code used to compute the force in a Context, and
+            global parameters take their default values. Frames are split among the
+            threads set with :func:`setNumThreads`.
+
+            Parameters
+            ----------
+            frames
+                an array of shape (F, N, 3) with the positions of all N particles in
+                each of F frames, in nanometers unless it is a Quantity. A C-contiguous
+                float64 array, including a memory-mapped one, is read in place. Other
+                arrays are converted blockwise.
+            getRMSDs
+                whether to also return the RMSD with respect to each reference
+            getGradients
+                whether to also return the gradient of the energy with respect to the
+                positions
+            blockSize
+                the number of frames converted at a time when the array cannot be read
+                in place
+
+            Returns
+            -------
+            Quantity or Tuple[Quantity]
+                the energy in each frame, followed by an array of shape (F, R) with the
+                RMSDs to the R references and an array of shape (F, N, 3) with the
+                gradients, if requested
+            """
+            if unit.is_quantity(frames):
+                frames = frames.value_in_unit(unit.nanometers)
+            frames = np.asanyarray(frames)
+            if frames.ndim != 3 or frames.shape[2] != 3:
+                raise ValueError("frames must have shape (F, N, 3)")
+            numFrames = frames.shape[0]
+            energies = np.empty(numFrames)
+            rmsds = np.empty((numFrames, self.getNumReferences())) if getRMSDs else None
+            gradients = np.empty(frames.shape) if getGradients else None
+            if frames.dtype == np.float64 and frames.flags.c_contiguous:
+                blockSize = max(numFrames, 1)
+            for start in range(0, numFrames, blockSize):
+                stop = min(start + blockSize, numFrames)
+                self._computeBatch(
+                    np.ascontiguousarray(frames[start:stop], dtype=np.float64),
+                    energies[start:stop],
+                    None if rmsds is None else rmsds[start:stop],
+                    None if gradients is None else gradients[start:stop],
+                )
+            results = [unit.Quantity(energies, unit.kilojoules_per_mole)]
+            if getRMSDs:
+                results.append(unit.Quantity(rmsds, unit.nanometers))
+            if getGradients:
+                results.append(unit.Quantity(gradients, unit.kilojoules_per_mole/unit.nanometers))
+            return results[0] if len(results) == 1 else tuple(results)
+
+        def computeHessianTimesVector(self, context, direction):
+            """
+            Compute the product of the Hessian of the energy of this force, at the
+            current positions of a :OpenMM:`Context`, with a direction in configuration
+            space. The product is found analytically from the perturbation of the
+            optimal rotations, at a cost comparable to that of one force evaluation. This
+            force alone is evaluated, without computing the other forces in the Context,
+            if the positions or global parameters have changed since the last evaluation.
+            RMSDs that are zero, for which the Hessian is undefined, do not contribute to
+            the product.
+
+            Parameters
+            ----------
+            context
+                the :OpenMM:`Context` whose positions to compute the Hessian at
+            direction
+                the direction to multiply by, as an array of shape (N, 3) with a vector
+                for every particle in the System, in nanometers if it is a Quantity
+
+            Returns
+            -------
+            Quantity
+                an array of shape (N, 3) with the product, in kJ/mol/nm^2 times the units
+                of the direction
+            """
+            product = self._computeHessianTimesVector(context, direction)
+            if unit.is_quantity(direction):
+                return unit.Quantity(product, unit.kilojoules_per_mole/unit.nanometers)
+            return unit.Quantity(product, unit.kilojoules_per_mole/unit.nanometers**2)
+
+        def getReferencePositions(self, index=0, asNumpy=False):
+            """
+            Get the positions of a reference structure. Calling it without arguments
+            returns the reference positions passed to the constructor.
+
+            Parameters
+            ----------
+            index
+                the index of the reference whose positions are to be retrieved
+            asNumpy
+                whether to return a NumPy array of shape (N, 3) instead of a list of
+                Vec3, which is much faster for large systems
+
+            Returns
+            -------
+            Quantity
+                the reference positions, in nanometers
+            """
+            if asNumpy:
+                return unit.Quantity(self._getReferencePositionsArray(index), unit.nanometers)
+            return self._getReferencePositions(index)
+
+        def getGroup(self, index, asNumpy=False):
+            """
+            Get the particles of a group included in the composite RMSD calculation. If
+            the group is a range of particles, the returned list is empty and
+            :func:`getGroupRange` must be used instead.
+
+            Parameters
+            ----------
+            index
+                the index of the group whose particles are to be retrieved
+            asNumpy
+                whether to return an int32 NumPy array instead of a tuple
+
+            Returns
+            -------
+            Tuple[int]
+                the indices of the particles in the group
+            """
+            if asNumpy:
+                return self._getGroupArray(index)
+            return self._getGroup(index)
+
+        def getGroupReferencePositions(self, group, reference, asNumpy=False):
+            """
+            Get the positions of the particles of a group in a reference structure, if
+            they were given specifically for this group. Otherwise, the returned list is
+            empty.
+
+            Parameters
+            ----------
+            group
+                the index of the group
+            reference
+                the index of the reference structure
+            asNumpy
+                whether to return a NumPy array of shape (N, 3) instead of a list of
+                Vec3
+
+            Returns
+            -------
+            Quantity
+                the reference positions of the group, in nanometers
+            """
+            if asNumpy:
+                return unit.Quantity(self._getGroupReferencePositionsArray(group, reference), unit.nanometers)
+            return self._getGroupReferencePositions(group, reference)
+        %}
+
+        %feature("docstring") %{
+        Get the profile recorded in a :OpenMM:`Context` since profiling was enabled or
+        the profile was last reset.
+
+        Parameters
+        ----------
+        context
+            the :OpenMM:`Context` for which to get the profile
+
+        Returns
+        -------
+        Dict[str, float]
+            the numbers of evaluations ("evaluations"), of evaluations that reused the
+            previous result ("cacheHits"), of evaluations that skipped the forces
+            ("energyOnly"), of zero RMSDs ("zeroRMSDs"), of warm starts that did not
+            converge ("warmStartFallbacks"), and of eigenvalue problems solved by full
+            diagonalization ("solverFallbacks"), followed by the total times, in
+            seconds, spent gathering positions ("gatherTime"), accumulating
+            correlation matrices ("correlationTime"), solving for the RMSDs
+            ("eigenTime"), and computing forces ("forceTime"), and the number of
+            threads in use ("numThreads"), which is reported even if profiling is
+            disabled
+        %}
+        PyObject* getProfile(OpenMM::Context& context) {
+            std::map<std::string, double> profile;
+            self->getProfile(context, profile);
+            PyObject* dict = PyDict_New();
+            for (auto& entry : profile) {
+                PyObject* value = PyFloat_FromDouble(entry.second);
+                PyDict_SetItemString(dict, entry.first.c_str(), value);
+                Py_DECREF(value);
+            }
+            return dict;
+        }
+
         %feature("docstring") %{Cast a :OpenMM:`Force` to a :class:`CompositeRMSDForce`.%}
         static OpenMMCPPForces::CompositeRMSDForce& cast(OpenMM::Force& force) {
             return dynamic_cast<OpenMMCPPForces::CompositeRMSDForce&>(force);
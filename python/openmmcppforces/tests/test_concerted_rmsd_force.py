@@ -161,3 +161,189 @@ def test_single_group_rmsd():
     rmsd1 = rmsd1 / unit.kilojoule_per_mole
     ASSERT(rmsd1 <= estimate)
     ASSERT(rmsd1 > 0.9*estimate)
+
+
+def test_numpy_arrays():
+    numParticles = 30
+    random = np.random.default_rng(1)
+    referencePos = 10 * random.random((numParticles, 3))
+    positions = referencePos + 0.2 * random.random((numParticles, 3))
+    particles = np.arange(0, numParticles, 2)
+    system = mm.System()
+    for i in range(numParticles):
+        system.addParticle(1.0)
+
+    # Arrays, lists of Vec3, and quantities in other units must give the same force.
+
+    force1 = mmcpp.CompositeRMSDForce(referencePos)
+    force1.addGroup(particles)
+    force1.setForceGroup(0)
+    system.addForce(force1)
+    force2 = mmcpp.CompositeRMSDForce([mm.Vec3(*p) for p in 10 * referencePos])
+    force2.setReferencePositions((referencePos * 10) * unit.angstroms)
+    force2.addGroup([int(i) for i in particles])
+    force2.setForceGroup(1)
+    system.addForce(force2)
+    context = mm.Context(
+        system, mm.VerletIntegrator(0.001), mm.Platform.getPlatformByName("Reference")
+    )
+    context.setPositions(positions)
+    assert_forces_and_energy(context, 1e-6)
+
+    # Getters return arrays on request, in nanometers and with the same contents.
+
+    array = force2.getReferencePositions(asNumpy=True)
+    ASSERT(isinstance(array.value_in_unit(unit.nanometers), np.ndarray))
+    ASSERT(np.allclose(array.value_in_unit(unit.nanometers), referencePos))
+    ASSERT(array.value_in_unit(unit.nanometers).shape == (numParticles, 3))
+    group = force1.getGroup(0, asNumpy=True)
+    ASSERT(group.dtype == np.int32)
+    ASSERT(np.array_equal(group, particles))
+    ASSERT(tuple(force1.getGroup(0)) == tuple(int(i) for i in particles))
+    ASSERT(np.allclose(
+        value(force1.getReferencePositions(0)[1]), mm.Vec3(*referencePos[1])
+    ))
+
+    # Updating references and groups from arrays takes effect in the Context.
+
+    force1.setGroup(0, particles.astype(np.int64))
+    force1.setReferencePositions(0, positions)
+    force1.updateParametersInContext(context)
+    state = context.getState(getEnergy=True, groups={0})
+    ASSERT_EQUAL_TOL(0.0, state.getPotentialEnergy(), 1e-6)
+
+    try:
+        force1.setReferencePositions(np.zeros((numParticles, 2)))
+        ASSERT(False)
+    except ValueError:
+        pass
+    try:
+        force1.setGroup(0, np.array([0.5, 1.5]))
+        ASSERT(False)
+    except TypeError:
+        pass
+
+    # Indices that do not fit in a 32-bit integer are rejected instead of wrapped around.
+
+    for indices in [np.array([0, 2**32], dtype=np.int64), np.array([2**63], dtype=np.uint64), [1, -2**31-1]]:
+        try:
+            force1.setGroup(0, indices)
+            ASSERT(False)
+        except OverflowError:
+            pass
+    force1.setGroup(0, np.array([1, 2**31-1], dtype=np.int64))
+    ASSERT(tuple(force1.getGroup(0)) == (1, 2**31-1))
+
+
+def test_batch():
+    numParticles = 20
+    numFrames = 5
+    random = np.random.default_rng(2)
+    referencePos = 10 * random.random((numParticles, 3))
+    frames = referencePos + random.random((numFrames, numParticles, 3))
+    system = mm.System()
+    for i in range(numParticles):
+        system.addParticle(1.0)
+    force = mmcpp.CompositeRMSDForce(referencePos)
+    force.addReferencePositions(frames[0])
+    force.addGroup(np.arange(0, numParticles, 2))
+    force.addGroup(np.arange(1, numParticles, 2))
+    force.setEnergyFunction("k*rmsd0 + rmsd1")
+    force.addGlobalParameter("k", 2.0)
+    system.addForce(force)
+    context = mm.Context(
+        system, mm.VerletIntegrator(0.001), mm.Platform.getPlatformByName("Reference")
+    )
+
+    # The batch results must agree with a Context, also for frames stored as float32.
+
+    energies, rmsds, gradients = force.computeBatch(
+        frames, getRMSDs=True, getGradients=True
+    )
+    ASSERT(rmsds.value_in_unit(unit.nanometers).shape == (numFrames, 2))
+    for f in range(numFrames):
+        context.setPositions(frames[f])
+        state = context.getState(getEnergy=True, getForces=True)
+        ASSERT_EQUAL_TOL(state.getPotentialEnergy(), energies[f], 1e-10)
+        forces = state.getForces(asNumpy=True).value_in_unit(
+            unit.kilojoules_per_mole/unit.nanometers
+        )
+        ASSERT(np.allclose(forces, -gradients[f].value_in_unit(gradients.unit)))
+    ASSERT_EQUAL_TOL(0.0, rmsds[0][1], 1e-6)
+    single = frames.astype(np.float32)
+    ASSERT(np.array_equal(
+        value(force.computeBatch(single, blockSize=2)),
+        value(force.computeBatch(single.astype(np.float64))),
+    ))
+
+    # Output arrays that cannot be written in place, and frames or outputs of the wrong
+    # shape, are rejected instead of being read or written out of bounds.
+
+    energies = np.empty(numFrames)
+    for args, error in [
+        ((frames, energies.astype(np.float32), None, None), TypeError),
+        ((frames, np.empty(2*numFrames)[::2], None, None), TypeError),
+        ((frames, np.empty(numFrames + 1), None, None), ValueError),
+        ((frames, energies, np.empty((numFrames, 3)), None), ValueError),
+        ((frames, energies, None, np.empty((numFrames, numParticles - 1, 3))), ValueError),
+        ((frames[:, :, :2], energies, None, None), ValueError),
+        ((frames[0], energies, None, None), ValueError),
+    ]:
+        try:
+            force._computeBatch(*args)
+            ASSERT(False)
+        except error:
+            pass
+
+
+def test_profiling():
+    numParticles = 10
+    random = np.random.default_rng(3)
+    referencePos = 10 * random.random((numParticles, 3))
+    system = mm.System()
+    for i in range(numParticles):
+        system.addParticle(1.0)
+    force = mmcpp.CompositeRMSDForce(referencePos)
+    force.addGroup([])
+    force.setUseProfiling(True)
+    system.addForce(force)
+    context = mm.Context(
+        system, mm.VerletIntegrator(0.001), mm.Platform.getPlatformByName("Reference")
+    )
+    context.setPositions(referencePos + random.random((numParticles, 3)))
+    context.getState(getForces=True)
+    context.getState(getForces=True)
+    profile = force.getProfile(context)
+    ASSERT(profile["evaluations"] == 2)
+    ASSERT(profile["cacheHits"] == 1)
+    ASSERT(profile["numThreads"] == 1)
+    force.resetProfile(context)
+    ASSERT(force.getProfile(context)["evaluations"] == 0)
+
+
+def test_hessian_times_vector():
+    numParticles = 12
+    random = np.random.default_rng(4)
+    referencePos = 10 * random.random((numParticles, 3))
+    positions = referencePos + random.random((numParticles, 3))
+    direction = random.random((numParticles, 3)) - 0.5
+    system = mm.System()
+    for i in range(numParticles):
+        system.addParticle(1.0)
+    force = mmcpp.CompositeRMSDForce(referencePos)
+    force.addGroup([])
+    force.setEnergyFunction("rmsd0^2")
+    system.addForce(force)
+    context = mm.Context(
+        system, mm.VerletIntegrator(0.001), mm.Platform.getPlatformByName("Reference")
+    )
+    context.setPositions(positions)
+    product = force.computeHessianTimesVector(context, direction)
+    ASSERT(product.unit == unit.kilojoules_per_mole/unit.nanometers**2)
+    delta = 1e-5
+    forces = []
+    for sign in (1, -1):
+        context.setPositions(positions + sign * delta * direction)
+        state = context.getState(getForces=True)
+        forces.append(value(state.getForces(asNumpy=True)))
+    ASSERT(np.allclose(value(product), (forces[1] - forces[0]) / (2 * delta), atol=1e-5))
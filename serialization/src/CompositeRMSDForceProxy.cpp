@@ -13,53 +13,264 @@
 
 #include "openmm/serialization/SerializationNode.h"
 #include "openmm/Force.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
+#include <string>
+#include <vector>
 
 using namespace OpenMMCPPForces;
 using namespace OpenMM;
 using namespace std;
 
+// Arrays are stored as base64 strings of their little-endian binary representation,
+// which is much more compact and faster to parse than one node per element.
+
+static const char* BASE64_DIGITS = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static string encodeBase64(const vector<unsigned char>& bytes) {
+    string result;
+    result.reserve(4*((bytes.size()+2)/3));
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        int count = min((size_t) 3, bytes.size()-i);
+        uint32_t word = bytes[i] << 16;
+        if (count > 1)
+            word |= bytes[i+1] << 8;
+        if (count > 2)
+            word |= bytes[i+2];
+        for (int j = 0; j < 4; j++)
+            result += (j <= count ? BASE64_DIGITS[(word >> (18-6*j)) & 63] : '=');
+    }
+    return result;
+}
+
+static vector<unsigned char> decodeBase64(const string& text) {
+    int values[256];
+    fill(values, values+256, -1);
+    for (int i = 0; i < 64; i++)
+        values[(unsigned char) BASE64_DIGITS[i]] = i;
+    size_t size = text.size();
+    size_t padding = (size > 0 && text[size-1] == '=') + (size > 1 && text[size-2] == '=');
+    if (size%4 != 0)
+        throw OpenMMException("CompositeRMSDForceProxy: Invalid base64 data");
+    vector<unsigned char> bytes;
+    bytes.reserve(3*(size/4));
+    for (size_t i = 0; i < size; i += 4) {
+        uint32_t word = 0;
+        for (int j = 0; j < 4; j++) {
+            int value = (i+j < size-padding ? values[(unsigned char) text[i+j]] : 0);
+            if (value < 0)
+                throw OpenMMException("CompositeRMSDForceProxy: Invalid base64 data");
+            word = (word << 6) | value;
+        }
+        for (int j = 0; j < 3; j++)
+            bytes.push_back((word >> (16-8*j)) & 255);
+    }
+    bytes.resize(bytes.size()-padding);
+    return bytes;
+}
+
+static void appendBytes(vector<unsigned char>& bytes, uint64_t value, int size) {
+    for (int i = 0; i < size; i++)
+        bytes.push_back((value >> (8*i)) & 255);
+}
+
+static uint64_t readBytes(const vector<unsigned char>& bytes, size_t offset, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++)
+        value |= (uint64_t) bytes[offset+i] << (8*i);
+    return value;
+}
+
+// Positions and indices are checked when encoding in the same way as when decoding, so
+// that a force is never written in a form that cannot be read back.
+
+static string encodePositions(const vector<Vec3>& positions) {
+    vector<unsigned char> bytes;
+    bytes.reserve(24*positions.size());
+    for (const Vec3& pos : positions)
+        for (int i = 0; i < 3; i++) {
+            double coordinate = pos[i];
+            if (!isfinite(coordinate))
+                throw OpenMMException("CompositeRMSDForceProxy: Invalid position data");
+            uint64_t value;
+            memcpy(&value, &coordinate, sizeof(double));
+            appendBytes(bytes, value, 8);
+        }
+    return encodeBase64(bytes);
+}
+
+static vector<Vec3> decodePositions(const string& text) {
+    vector<unsigned char> bytes = decodeBase64(text);
+    if (bytes.size()%24 != 0)
+        throw OpenMMException("CompositeRMSDForceProxy: Invalid position data");
+    vector<Vec3> positions(bytes.size()/24);
+    for (size_t j = 0; j < positions.size(); j++)
+        for (int i = 0; i < 3; i++) {
+            uint64_t value = readBytes(bytes, 24*j+8*i, 8);
+            double coordinate;
+            memcpy(&coordinate, &value, sizeof(double));
+            if (!isfinite(coordinate))
+                throw OpenMMException("CompositeRMSDForceProxy: Invalid position data");
+            positions[j][i] = coordinate;
+        }
+    return positions;
+}
+
+// Particle indices are stored as runs of consecutive indices, each one given by its
+// first index and length as 32-bit integers.
+
+static string encodeIndices(const vector<int>& indices) {
+    vector<unsigned char> bytes;
+    for (size_t i = 0; i < indices.size(); ) {
+        if (indices[i] < 0)
+            throw OpenMMException("CompositeRMSDForceProxy: Invalid index data");
+        size_t j = i+1;
+        while (j < indices.size() && indices[j] == (long long) indices[j-1]+1)
+            j++;
+        appendBytes(bytes, (uint32_t) indices[i], 4);
+        appendBytes(bytes, (uint32_t) (j-i), 4);
+        i = j;
+    }
+    return encodeBase64(bytes);
+}
+
+static vector<int> decodeIndices(const string& text) {
+    // Every run must be non-empty and consist of valid indices, and the runs must add up
+    // to no more indices than an int can count.  The total is checked before allocating
+    // memory, so that corrupted data cannot request an arbitrary amount of it.
+
+    vector<unsigned char> bytes = decodeBase64(text);
+    if (bytes.size()%8 != 0)
+        throw OpenMMException("CompositeRMSDForceProxy: Invalid index data");
+    vector<pair<int, int> > runs;
+    long long total = 0;
+    for (size_t i = 0; i < bytes.size(); i += 8) {
+        int first = (int32_t) readBytes(bytes, i, 4);
+        int length = (int32_t) readBytes(bytes, i+4, 4);
+        total += length;
+        if (first < 0 || length <= 0 || (long long) first+length-1 > INT_MAX || total > INT_MAX)
+            throw OpenMMException("CompositeRMSDForceProxy: Invalid index data");
+        runs.push_back(make_pair(first, length));
+    }
+    vector<int> indices;
+    indices.reserve(total);
+    for (auto& run : runs)
+        for (int j = 0; j < run.second; j++)
+            indices.push_back(run.first+j);
+    return indices;
+}
+
 CompositeRMSDForceProxy::CompositeRMSDForceProxy() : SerializationProxy("CompositeRMSDForce") {
 }
 
 void CompositeRMSDForceProxy::serialize(const void* object, SerializationNode& node) const {
-    node.setIntProperty("version", 0);
+    node.setIntProperty("version", 1);
     const CompositeRMSDForce& force = *reinterpret_cast<const CompositeRMSDForce*>(object);
     node.setIntProperty("forceGroup", force.getForceGroup());
     node.setStringProperty("name", force.getName());
-    SerializationNode& positionsNode = node.createChildNode("ReferencePositions");
-    for (const Vec3& pos : force.getReferencePositions())
-       positionsNode.createChildNode("Position").setDoubleProperty("x", pos[0]).setDoubleProperty("y", pos[1]).setDoubleProperty("z", pos[2]);
+    node.setIntProperty("numThreads", force.getNumThreads());
+    node.setBoolProperty("useWarmStart", force.getUseWarmStart());
+    node.setDoubleProperty("alignmentTolerance", force.getAlignmentTolerance());
+    node.setBoolProperty("useMixedPrecision", force.getUseMixedPrecision());
+    node.setBoolProperty("useProfiling", force.getUseProfiling());
+    node.setBoolProperty("useAutotuning", force.getUseAutotuning());
+    node.setStringProperty("energyFunction", force.getEnergyFunction());
+    node.createChildNode("ReferencePositions").setStringProperty("positions", encodePositions(force.getReferencePositions()));
+    if (force.getNumReferences() > 1) {
+        SerializationNode& referencesNode = node.createChildNode("AdditionalReferences");
+        for (int i = 1; i < force.getNumReferences(); i++)
+            referencesNode.createChildNode("ReferencePositions").setStringProperty("positions", encodePositions(force.getReferencePositions(i)));
+    }
+    SerializationNode& globalParams = node.createChildNode("GlobalParameters");
+    for (int i = 0; i < force.getNumGlobalParameters(); i++)
+        globalParams.createChildNode("Parameter").setStringProperty("name", force.getGlobalParameterName(i)).setDoubleProperty("default", force.getGlobalParameterDefaultValue(i));
     SerializationNode& groupsNode = node.createChildNode("Groups");
     for (int i = 0; i < force.getNumGroups(); i++) {
-        const vector<int>& group = force.getGroup(i);
         SerializationNode& groupNode = groupsNode.createChildNode("Group");
-        for (int particle : group)
-            groupNode.createChildNode("Particle").setIntProperty("index", particle);
+        if (force.getGroupIsRange(i)) {
+            int first, last;
+            force.getGroupRange(i, first, last);
+            groupNode.setIntProperty("first", first).setIntProperty("last", last);
+        }
+        else
+            groupNode.setStringProperty("indices", encodeIndices(force.getGroup(i)));
+        for (int j = 0; j < force.getNumReferences(); j++) {
+            const vector<Vec3>& positions = force.getGroupReferencePositions(i, j);
+            if (positions.size() > 0)
+                groupNode.createChildNode("ReferencePositions").setIntProperty("reference", j).setStringProperty("positions", encodePositions(positions));
+        }
     }
 }
 
 void* CompositeRMSDForceProxy::deserialize(const SerializationNode& node) const {
     int version = node.getIntProperty("version");
-    if (version != 0)
+    if (version < 0 || version > 1)
         throw OpenMMException("Unsupported version number");
     CompositeRMSDForce* force = NULL;
-    try {
+
+    // Version 0 stores every position and particle index as a separate node.
+
+    auto readPositions = [&] (const SerializationNode& positionsNode) -> vector<Vec3> {
+        if (version > 0)
+            return decodePositions(positionsNode.getStringProperty("positions"));
         vector<Vec3> positions;
-        for (auto& pos : node.getChildNode("ReferencePositions").getChildren())
+        for (auto& pos : positionsNode.getChildren())
             positions.push_back(Vec3(pos.getDoubleProperty("x"), pos.getDoubleProperty("y"), pos.getDoubleProperty("z")));
+        return positions;
+    };
+    try {
+        vector<Vec3> positions = readPositions(node.getChildNode("ReferencePositions"));
+        vector<vector<Vec3>> references;
+        vector<pair<string, double>> globalParams;
+        for (auto& child : node.getChildren()) {
+            if (child.getName() == "AdditionalReferences")
+                for (auto& reference : child.getChildren())
+                    references.push_back(readPositions(reference));
+            if (child.getName() == "GlobalParameters")
+                for (auto& parameter : child.getChildren())
+                    globalParams.push_back(make_pair(parameter.getStringProperty("name"), parameter.getDoubleProperty("default")));
+        }
         vector<vector<int>> groups;
+        vector<pair<int, int>> ranges;
+        vector<pair<pair<int, int>, vector<Vec3>>> groupReferences;
         for (auto& group : node.getChildNode("Groups").getChildren()) {
             vector<int> particles;
-            for (auto& particle : group.getChildren())
-                particles.push_back(particle.getIntProperty("index"));
+            if (version > 0)
+                particles = decodeIndices(group.getStringProperty("indices", ""));
+            for (auto& child : group.getChildren()) {
+                if (child.getName() == "Particle")
+                    particles.push_back(child.getIntProperty("index"));
+                if (child.getName() == "ReferencePositions")
+                    groupReferences.push_back(make_pair(make_pair((int) groups.size(), child.getIntProperty("reference")), readPositions(child)));
+            }
             groups.push_back(particles);
+            ranges.push_back(make_pair(group.getIntProperty("first", 0), group.getIntProperty("last", 0)));
         }
         force = new CompositeRMSDForce(positions);
-        for (auto& particles : groups)
-            force->addGroup(particles);
+        for (auto& referencePositions : references)
+            force->addReferencePositions(referencePositions);
+        for (int i = 0; i < groups.size(); i++)
+            if (ranges[i].second > 0)
+                force->addGroupRange(ranges[i].first, ranges[i].second);
+            else
+                force->addGroup(groups[i]);
+        for (auto& reference : groupReferences)
+            force->setGroupReferencePositions(reference.first.first, reference.first.second, reference.second);
+        for (auto& parameter : globalParams)
+            force->addGlobalParameter(parameter.first, parameter.second);
         force->setForceGroup(node.getIntProperty("forceGroup", 0));
         force->setName(node.getStringProperty("name", force->getName()));
+        force->setNumThreads(node.getIntProperty("numThreads", 1));
+        force->setUseWarmStart(node.getBoolProperty("useWarmStart", false));
+        force->setAlignmentTolerance(node.getDoubleProperty("alignmentTolerance", 1e-14));
+        force->setUseMixedPrecision(node.getBoolProperty("useMixedPrecision", false));
+        force->setUseProfiling(node.getBoolProperty("useProfiling", false));
+        force->setUseAutotuning(node.getBoolProperty("useAutotuning", false));
+        force->setEnergyFunction(node.getStringProperty("energyFunction", "rmsd0"));
         return force;
     }
     catch (...) {
@@ -12,6 +12,7 @@
 
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/serialization/XmlSerializer.h"
+#include <cmath>
 #include <iostream>
 #include <sstream>
 
@@ -30,8 +31,22 @@ void testSerialization() {
         particles.push_back(i*i);
     CompositeRMSDForce force(refPos);
     force.addGroup(particles);
+    force.addGroupRange(5, 9);
     force.setForceGroup(3);
     force.setName("custom name");
+    force.setNumThreads(4);
+    force.setUseWarmStart(true);
+    force.setAlignmentTolerance(1e-10);
+    force.setUseMixedPrecision(true);
+    force.setUseProfiling(true);
+    force.setUseAutotuning(true);
+    vector<Vec3> refPos2;
+    for (int i = 0; i < 10; i++)
+        refPos2.push_back(Vec3(i*0.7, i/3.0, 1.5-i));
+    force.addReferencePositions(refPos2);
+    force.setEnergyFunction("k*min(rmsd0, rmsd1)");
+    force.addGlobalParameter("k", 2.5);
+    force.setGroupReferencePositions(1, 1, vector<Vec3>(refPos2.begin()+5, refPos2.begin()+9));
 
     // Serialize and then deserialize it.
 
@@ -44,17 +59,150 @@ void testSerialization() {
     CompositeRMSDForce& force2 = *copy;
     ASSERT_EQUAL(force.getForceGroup(), force2.getForceGroup());
     ASSERT_EQUAL(force.getName(), force2.getName());
-    ASSERT_EQUAL(force.getReferencePositions().size(), force2.getReferencePositions().size());
-    for (int i = 0; i < force.getReferencePositions().size(); i++)
-        ASSERT_EQUAL_VEC(force.getReferencePositions()[i], force2.getReferencePositions()[i], 0.0);
+    ASSERT_EQUAL(force.getNumThreads(), force2.getNumThreads());
+    ASSERT_EQUAL(force.getUseWarmStart(), force2.getUseWarmStart());
+    ASSERT_EQUAL(force.getAlignmentTolerance(), force2.getAlignmentTolerance());
+    ASSERT_EQUAL(force.getUseMixedPrecision(), force2.getUseMixedPrecision());
+    ASSERT_EQUAL(force.getUseProfiling(), force2.getUseProfiling());
+    ASSERT_EQUAL(force.getUseAutotuning(), force2.getUseAutotuning());
+    ASSERT_EQUAL(force.getEnergyFunction(), force2.getEnergyFunction());
+    ASSERT_EQUAL(force.getNumGlobalParameters(), force2.getNumGlobalParameters());
+    for (int i = 0; i < force.getNumGlobalParameters(); i++) {
+        ASSERT_EQUAL(force.getGlobalParameterName(i), force2.getGlobalParameterName(i));
+        ASSERT_EQUAL(force.getGlobalParameterDefaultValue(i), force2.getGlobalParameterDefaultValue(i));
+    }
+    ASSERT_EQUAL(force.getNumReferences(), force2.getNumReferences());
+    for (int k = 0; k < force.getNumReferences(); k++) {
+        ASSERT_EQUAL(force.getReferencePositions(k).size(), force2.getReferencePositions(k).size());
+        for (int i = 0; i < force.getReferencePositions(k).size(); i++)
+            ASSERT_EQUAL_VEC(force.getReferencePositions(k)[i], force2.getReferencePositions(k)[i], 0.0);
+    }
+    ASSERT_EQUAL(force.getNumGroups(), force2.getNumGroups());
     ASSERT_EQUAL(force.getGroup(0).size(), force2.getGroup(0).size());
     for (int i = 0; i < force.getGroup(0).size(); i++)
         ASSERT_EQUAL(force.getGroup(0)[i], force2.getGroup(0)[i]);
+    ASSERT(!force2.getGroupIsRange(0));
+    ASSERT(force2.getGroupIsRange(1));
+    int first, last;
+    force2.getGroupRange(1, first, last);
+    ASSERT_EQUAL(5, first);
+    ASSERT_EQUAL(9, last);
+    for (int k = 0; k < force.getNumGroups(); k++)
+        for (int m = 0; m < force.getNumReferences(); m++) {
+            ASSERT_EQUAL(force.getGroupReferencePositions(k, m).size(), force2.getGroupReferencePositions(k, m).size());
+            for (int i = 0; i < force.getGroupReferencePositions(k, m).size(); i++)
+                ASSERT_EQUAL_VEC(force.getGroupReferencePositions(k, m)[i], force2.getGroupReferencePositions(k, m)[i], 0.0);
+        }
+}
+
+void testVersion0() {
+    // Forces serialized in the original format, with one node per position and particle
+    // index, should still be readable.
+
+    stringstream buffer;
+    buffer << "<?xml version=\"1.0\" ?>\n"
+           << "<Force type=\"CompositeRMSDForce\" version=\"0\" forceGroup=\"2\" name=\"old force\">\n"
+           << "<ReferencePositions>\n"
+           << "<Position x=\"0.5\" y=\"1\" z=\"-2\"/>\n"
+           << "<Position x=\"1.5\" y=\"0\" z=\"3\"/>\n"
+           << "<Position x=\"2\" y=\"0.25\" z=\"1\"/>\n"
+           << "</ReferencePositions>\n"
+           << "<Groups>\n"
+           << "<Group>\n"
+           << "<Particle index=\"2\"/>\n"
+           << "<Particle index=\"0\"/>\n"
+           << "</Group>\n"
+           << "</Groups>\n"
+           << "</Force>\n";
+    CompositeRMSDForce* force = XmlSerializer::deserialize<CompositeRMSDForce>(buffer);
+    ASSERT_EQUAL(2, force->getForceGroup());
+    ASSERT_EQUAL("old force", force->getName());
+    ASSERT_EQUAL(1, force->getNumReferences());
+    ASSERT_EQUAL(3, force->getReferencePositions().size());
+    ASSERT_EQUAL_VEC(Vec3(1.5, 0, 3), force->getReferencePositions()[1], 0.0);
+    ASSERT_EQUAL(1, force->getNumGroups());
+    ASSERT_EQUAL(2, force->getGroup(0).size());
+    ASSERT_EQUAL(2, force->getGroup(0)[0]);
+    ASSERT_EQUAL(0, force->getGroup(0)[1]);
+    ASSERT_EQUAL("rmsd0", force->getEnergyFunction());
+    delete force;
+}
+
+void testInvalidData() {
+    // Corrupted arrays should be rejected instead of producing arbitrary forces.  The
+    // index runs are, in order: a truncated run, a negative length, a negative first
+    // index, a run past the largest index, and runs adding up to too many indices.  The
+    // positions are a truncated position and a position with a NaN coordinate.
+
+    auto deserialize = [] (const string& positions, const string& indices) {
+        stringstream buffer;
+        buffer << "<?xml version=\"1.0\" ?>\n"
+               << "<Force type=\"CompositeRMSDForce\" version=\"1\">\n"
+               << "<ReferencePositions positions=\"" << positions << "\"/>\n"
+               << "<GlobalParameters/>\n"
+               << "<Groups><Group indices=\"" << indices << "\"/></Groups>\n"
+               << "</Force>\n";
+        delete XmlSerializer::deserialize<CompositeRMSDForce>(buffer);
+    };
+    deserialize("", "AAAAAAIAAAA=");
+    vector<pair<string, string> > invalid = {
+        {"", "AAAAAA=="},
+        {"", "AAAAAP////8="},
+        {"", "/f///wIAAAA="},
+        {"", "8P//fwABAAA="},
+        {"", "AAAAAP///38AAAAA////fw=="},
+        {"AAAAAAAA8D8=", "AAAAAAIAAAA="},
+        {"AAAAAAAA8D8AAAAAAAD4fwAAAAAAAAAA", "AAAAAAIAAAA="}
+    };
+    for (auto& data : invalid) {
+        bool thrown = false;
+        try {
+            deserialize(data.first, data.second);
+        }
+        catch (const OpenMMException& e) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+}
+
+void testInvalidForce() {
+    // A force with data that would be rejected when deserialized should not be
+    // serialized either, while the extreme valid values should survive a round trip.
+
+    auto roundTrip = [] (const CompositeRMSDForce& force) {
+        stringstream buffer;
+        XmlSerializer::serialize<CompositeRMSDForce>(&force, "Force", buffer);
+        delete XmlSerializer::deserialize<CompositeRMSDForce>(buffer);
+    };
+    vector<Vec3> refPos(3, Vec3(1.0, 2.0, 3.0));
+    CompositeRMSDForce valid(refPos);
+    valid.addGroup({0, 2147483646, 2147483647});
+    roundTrip(valid);
+    vector<CompositeRMSDForce> invalid(4, CompositeRMSDForce(refPos));
+    invalid[0].addGroup({0, -1, 2});
+    invalid[1].addGroup({-3, -2});
+    invalid[2].setReferencePositions({Vec3(1.0, 2.0, 3.0), Vec3(NAN, 0.0, 0.0), Vec3()});
+    invalid[2].addGroup({0, 1, 2});
+    invalid[3].addGroup({0, 1}, {Vec3(), Vec3(0.0, INFINITY, 0.0)});
+    for (auto& force : invalid) {
+        bool thrown = false;
+        try {
+            roundTrip(force);
+        }
+        catch (const OpenMMException& e) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
 }
 
 int main() {
     try {
         testSerialization();
+        testVersion0();
+        testInvalidData();
+        testInvalidForce();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;
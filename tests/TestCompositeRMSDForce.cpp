@@ -146,10 +146,782 @@ void testRMSD() {
     ASSERT(rmsd1 > 0.9*estimate);
 }
 
+void testCollinearRMSD() {
+    // When all particles lie on a line, the largest eigenvalue of the key matrix is
+    // degenerate.  The RMSD is then the deviation of the distances along the line.
+
+    const int numParticles = 10;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    Vec3 u = Vec3(1.0, 2.0, 2.0)/3.0, v = Vec3(0.0, 0.6, 0.8);
+    double expected = 0.0;
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        double t = i-0.5*(numParticles-1), s = 1.1*t;
+        referencePos[i] = u*t + Vec3(1.0, 2.0, 3.0);
+        positions[i] = v*s - Vec3(4.0, 0.5, 1.0);
+        expected += (s-t)*(s-t);
+    }
+    expected = sqrt(expected/numParticles);
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(vector<int>());
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    ASSERT_EQUAL_TOL(expected, context.getState(State::Energy).getPotentialEnergy(), 1e-6);
+}
+
+void testMultithreading() {
+    // Computing the force with any number of threads should give exactly the same results
+    // as with one.
+
+    const int numParticles = 3000;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%3 == 0)
+            group1.push_back(i);
+        else
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+    for (int numThreads : {2, 3, 4, 7}) {
+        force->setNumThreads(numThreads);
+        force->updateParametersInContext(context);
+        State state2 = context.getState(State::Energy | State::Forces);
+        ASSERT(state1.getPotentialEnergy() == state2.getPotentialEnergy());
+        for (int i = 0; i < numParticles; i++)
+            ASSERT(state1.getForces()[i] == state2.getForces()[i]);
+    }
+}
+
+void testWarmStart() {
+    // Starting the search for the optimal rotation from the previous one should not
+    // change the results along a trajectory.
+
+    const int numParticles = 50;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(vector<int>());
+    system.addForce(force);
+    CompositeRMSDForce* warmForce = new CompositeRMSDForce(referencePos);
+    warmForce->addGroup(vector<int>());
+    warmForce->setUseWarmStart(true);
+    warmForce->setForceGroup(1);
+    system.addForce(warmForce);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    for (int step = 0; step < 20; step++) {
+        for (int i = 0; i < numParticles; ++i)
+            positions[i] += Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5)*0.05;
+        context.setPositions(positions);
+        State state1 = context.getState(State::Energy | State::Forces, false, 1<<0);
+        State state2 = context.getState(State::Energy | State::Forces, false, 1<<1);
+        ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-10);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-8);
+    }
+}
+
+void testMultipleGroupsGradient() {
+    // The forces should be the negative gradient of the composite RMSD when there are
+    // several groups of different sizes and some particles belong to none of them.
+
+    const int numParticles = 30;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i < 8)
+            group1.push_back(i);
+        else if (i%4 != 0)
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    vector<Vec3> forces = context.getState(State::Forces).getForces();
+    const double delta = 1e-5;
+    for (int i = 0; i < numParticles; i++)
+        for (int j = 0; j < 3; j++) {
+            vector<Vec3> displaced = positions;
+            displaced[i][j] = positions[i][j] + delta;
+            context.setPositions(displaced);
+            double energy1 = context.getState(State::Energy).getPotentialEnergy();
+            displaced[i][j] = positions[i][j] - delta;
+            context.setPositions(displaced);
+            double energy2 = context.getState(State::Energy).getPotentialEnergy();
+            ASSERT_EQUAL_TOL(forces[i][j], (energy2-energy1)/(2*delta), 1e-5);
+        }
+}
+
+void testMultipleReferences() {
+    // A force with two references and a custom energy function should be equivalent to
+    // two single-reference forces combined in the same way.
+
+    const int numParticles = 40;
+    System system;
+    vector<Vec3> referencePos1(numParticles), referencePos2(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos1[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        referencePos2[i] = referencePos1[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*2;
+        positions[i] = referencePos1[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%2 == 0)
+            group1.push_back(i);
+        else
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos1);
+    ASSERT_EQUAL(1, force->addReferencePositions(referencePos2));
+    ASSERT_EQUAL(2, force->getNumReferences());
+    force->setEnergyFunction("rmsd0^2 + 2*rmsd1");
+    vector<CompositeRMSDForce*> singleForces;
+    singleForces.push_back(new CompositeRMSDForce(referencePos1));
+    singleForces.push_back(new CompositeRMSDForce(referencePos2));
+    for (CompositeRMSDForce* f : {force, singleForces[0], singleForces[1]}) {
+        f->addGroup(group1);
+        f->addGroup(group2);
+        system.addForce(f);
+    }
+    singleForces[0]->setForceGroup(1);
+    singleForces[1]->setForceGroup(2);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state = context.getState(State::Energy | State::Forces, false, 1<<0);
+    State state1 = context.getState(State::Energy | State::Forces, false, 1<<1);
+    State state2 = context.getState(State::Energy | State::Forces, false, 1<<2);
+    double rmsd1 = state1.getPotentialEnergy(), rmsd2 = state2.getPotentialEnergy();
+    ASSERT_EQUAL_TOL(rmsd1*rmsd1 + 2*rmsd2, state.getPotentialEnergy(), 1e-10);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i]*(2*rmsd1) + state2.getForces()[i]*2, state.getForces()[i], 1e-8);
+
+    // Variables that do not correspond to a reference should be rejected, leaving the
+    // Context as it was before the update.
+
+    force->setEnergyFunction("rmsd0 + rmsd2");
+    bool thrown = false;
+    try {
+        force->updateParametersInContext(context);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    State state3 = context.getState(State::Energy | State::Forces, false, 1<<0);
+    ASSERT_EQUAL_TOL(state.getPotentialEnergy(), state3.getPotentialEnergy(), 1e-12);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state.getForces()[i], state3.getForces()[i], 1e-12);
+}
+
+void testGroupRMSDs() {
+    // Aligning each group with the optimal rotation should reproduce the per-group RMSDs,
+    // which should in turn add up to the composite RMSD.
+
+    const int numParticles = 30;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<vector<int>> groups(3);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*(i%3+1)*0.2;
+        groups[i%3].push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    for (auto& group : groups)
+        force->addGroup(group);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    double rmsd = context.getState(State::Energy).getPotentialEnergy();
+    vector<double> rmsds, q;
+    force->getGroupRMSDs(context, rmsds);
+    force->getOptimalRotation(context, q);
+    ASSERT_EQUAL(3, rmsds.size());
+    ASSERT_EQUAL_TOL(1.0, q[0]*q[0]+q[1]*q[1]+q[2]*q[2]+q[3]*q[3], 1e-10);
+    double U[3][3] = {{q[0]*q[0]+q[1]*q[1]-q[2]*q[2]-q[3]*q[3], 2*(q[1]*q[2]-q[0]*q[3]), 2*(q[1]*q[3]+q[0]*q[2])},
+                      {2*(q[1]*q[2]+q[0]*q[3]), q[0]*q[0]-q[1]*q[1]+q[2]*q[2]-q[3]*q[3], 2*(q[2]*q[3]-q[0]*q[1])},
+                      {2*(q[1]*q[3]-q[0]*q[2]), 2*(q[2]*q[3]+q[0]*q[1]), q[0]*q[0]-q[1]*q[1]-q[2]*q[2]+q[3]*q[3]}};
+    double total = 0.0;
+    for (int k = 0; k < 3; k++) {
+        Vec3 center, referenceCenter;
+        for (int i : groups[k]) {
+            center += positions[i];
+            referenceCenter += referencePos[i];
+        }
+        center /= groups[k].size();
+        referenceCenter /= groups[k].size();
+        double sum = 0.0;
+        for (int i : groups[k]) {
+            Vec3 p = positions[i]-center;
+            Vec3 delta = Vec3(U[0][0]*p[0] + U[0][1]*p[1] + U[0][2]*p[2],
+                              U[1][0]*p[0] + U[1][1]*p[1] + U[1][2]*p[2],
+                              U[2][0]*p[0] + U[2][1]*p[1] + U[2][2]*p[2]) - (referencePos[i]-referenceCenter);
+            sum += delta.dot(delta);
+        }
+        total += sum;
+        ASSERT_EQUAL_TOL(sqrt(sum/groups[k].size()), rmsds[k], 1e-8);
+    }
+    ASSERT_EQUAL_TOL(rmsd, sqrt(total/numParticles), 1e-8);
+}
+
+void testGlobalParameters() {
+    // The energy function can depend on global parameters, whose values are taken from
+    // the Context.
+
+    const int numParticles = 20;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(vector<int>());
+    force->setEnergyFunction("0.5*k*(rmsd0-r0)^2");
+    force->addGlobalParameter("k", 2.0);
+    force->addGlobalParameter("r0", 0.1);
+    system.addForce(force);
+    CompositeRMSDForce* plainForce = new CompositeRMSDForce(referencePos);
+    plainForce->addGroup(vector<int>());
+    plainForce->setForceGroup(1);
+    system.addForce(plainForce);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state = context.getState(State::Forces, false, 1<<1);
+    double rmsd = context.getState(State::Energy, false, 1<<1).getPotentialEnergy();
+    for (double k : {2.0, 5.0}) {
+        context.setParameter("k", k);
+        State state1 = context.getState(State::Energy | State::Forces, false, 1<<0);
+        ASSERT_EQUAL_TOL(0.5*k*(rmsd-0.1)*(rmsd-0.1), state1.getPotentialEnergy(), 1e-10);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state.getForces()[i]*(k*(rmsd-0.1)), state1.getForces()[i], 1e-8);
+    }
+}
+
+void testMixedPrecision() {
+    // Mixed precision should agree with double precision to within single precision
+    // accuracy.
+
+    const int numParticles = 1000;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%3 == 0)
+            group1.push_back(i);
+        else
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+    force->setUseMixedPrecision(true);
+    force->updateParametersInContext(context);
+    State state2 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+}
+
+void testIncrementalUpdates() {
+    // Updating only the reference positions, or restoring the groups after a failed
+    // update, should give the same results as a new Context.
+
+    const int numParticles = 200;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%2 == 0)
+            group1.push_back(i);
+        else if (i%3 == 0)
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    context1.getState(State::Energy);
+    for (int i = 0; i < numParticles; i++)
+        referencePos[i] = referencePos[i]*1.05 + Vec3(0.1, 0.2, 0.3);
+    force->setReferencePositions(referencePos);
+    force->updateParametersInContext(context1);
+    vector<int> invalidGroup = group2;
+    invalidGroup.push_back(group1[0]);
+    force->setGroup(1, invalidGroup);
+    bool thrown = false;
+    try {
+        force->updateParametersInContext(context1);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    force->setGroup(1, group2);
+    force->updateParametersInContext(context1);
+    State state1 = context1.getState(State::Energy | State::Forces);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state1.getPotentialEnergy(), 1e-12);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state2.getForces()[i], state1.getForces()[i], 1e-12);
+}
+
+void testGroupRanges() {
+    // Groups given as ranges should give the same results as explicit lists of the
+    // same particles.
+
+    const int numParticles = 1500;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i >= 100 && i < 700)
+            group1.push_back(i);
+        else if (i >= 700 && i < 1300)
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    State state1 = context.getState(State::Energy | State::Forces);
+    force->setGroupRange(0, 100, 700);
+    force->setGroupRange(1, 700, 1300);
+    force->updateParametersInContext(context);
+    State state2 = context.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-12);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-12);
+    int first, last;
+    force->getGroupRange(1, first, last);
+    ASSERT_EQUAL(700, first);
+    ASSERT_EQUAL(1300, last);
+    ASSERT(force->getGroup(1).empty());
+}
+
+void testGroupReferencePositions() {
+    // Giving reference positions only for the particles in groups should give the same
+    // results as giving them for the whole system.
+
+    const int numParticles = 300;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%3 == 0)
+            group1.push_back(i);
+        else if (i%3 == 1)
+            group2.insert(group2.begin(), i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces);
+
+    vector<Vec3> groupPos1, groupPos2;
+    for (int i : group1)
+        groupPos1.push_back(referencePos[i]);
+    for (int i : group2)
+        groupPos2.push_back(referencePos[i]);
+    System system2;
+    for (int i = 0; i < numParticles; ++i)
+        system2.addParticle(1.0);
+    CompositeRMSDForce* force2 = new CompositeRMSDForce(vector<Vec3>());
+    force2->addGroup(group1, groupPos1);
+    force2->addGroup(group2, groupPos2);
+    system2.addForce(force2);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system2, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-12);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-12);
+
+    // Changing a group without changing its reference positions should be rejected,
+    // leaving the layout and the references of the Context untouched.
+
+    vector<int> shortGroup(group1.begin(), group1.end()-1);
+    force2->setGroup(0, shortGroup);
+    bool thrown = false;
+    try {
+        force2->updateParametersInContext(context2);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    State state3 = context2.getState(State::Energy | State::Forces);
+    ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state3.getPotentialEnergy(), 1e-12);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state2.getForces()[i], state3.getForces()[i], 1e-12);
+}
+
+void testSharedData() {
+    // Contexts with identical forces share their reference data, so updating the force
+    // in one of them should not affect the others.
+
+    const int numParticles = 200;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    vector<int> group;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%2 == 0)
+            group.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(group);
+    system.addForce(force);
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context1(system, integrator1, platform);
+    Context context2(system, integrator2, platform);
+    context1.setPositions(positions);
+    context2.setPositions(positions);
+    double energy = context1.getState(State::Energy).getPotentialEnergy();
+    ASSERT_EQUAL(energy, context2.getState(State::Energy).getPotentialEnergy());
+    force->setReferencePositions(positions);
+    force->updateParametersInContext(context2);
+    ASSERT_EQUAL_TOL(0.0, context2.getState(State::Energy).getPotentialEnergy(), 1e-6);
+    ASSERT_EQUAL(energy, context1.getState(State::Energy).getPotentialEnergy());
+    group.pop_back();
+    force->setGroup(0, group);
+    force->updateParametersInContext(context1);
+    ASSERT_EQUAL_TOL(0.0, context2.getState(State::Energy).getPotentialEnergy(), 1e-6);
+    ASSERT_EQUAL_TOL(0.0, context1.getState(State::Energy).getPotentialEnergy(), 1e-6);
+}
+
+void testBatch() {
+    // A batch of frames evaluated without a Context should give the same energies and
+    // forces as a Context, for any number of threads.
+
+    const int numParticles = 50;
+    const int numFrames = 7;
+    System system;
+    vector<Vec3> referencePos(numParticles), otherPos(numParticles);
+    vector<double> frames(3*numParticles*numFrames);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        otherPos[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        if (i%3 == 0)
+            group1.push_back(i);
+        else if (i%3 == 1)
+            group2.push_back(i);
+    }
+    for (int k = 0; k < frames.size(); k++)
+        frames[k] = referencePos[(k/3)%numParticles][k%3] + genrand_real2(sfmt);
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addReferencePositions(otherPos);
+    force->addGroup(group1);
+    force->addGroup(group2);
+    force->setEnergyFunction("k*rmsd0+rmsd1^2");
+    force->addGlobalParameter("k", 3.0);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    vector<double> energies(numFrames), rmsds(2*numFrames), gradients(frames.size());
+    force->computeBatch(&frames[0], numFrames, numParticles, &energies[0], &rmsds[0], &gradients[0]);
+    for (int f = 0; f < numFrames; f++) {
+        vector<Vec3> positions(numParticles);
+        for (int i = 0; i < numParticles; i++)
+            positions[i] = Vec3(frames[3*(numParticles*f+i)], frames[3*(numParticles*f+i)+1], frames[3*(numParticles*f+i)+2]);
+        context.setPositions(positions);
+        State state = context.getState(State::Energy | State::Forces);
+        ASSERT_EQUAL_TOL(state.getPotentialEnergy(), energies[f], 1e-10);
+        ASSERT_EQUAL_TOL(3.0*rmsds[2*f]+rmsds[2*f+1]*rmsds[2*f+1], energies[f], 1e-10);
+        for (int i = 0; i < numParticles; i++) {
+            const double* gradient = &gradients[3*(numParticles*f+i)];
+            ASSERT_EQUAL_VEC(state.getForces()[i], -Vec3(gradient[0], gradient[1], gradient[2]), 1e-8);
+        }
+    }
+    for (int threads : {0, 2, 3, 16}) {
+        force->setNumThreads(threads);
+        vector<double> energies2(numFrames), gradients2(frames.size());
+        force->computeBatch(&frames[0], numFrames, numParticles, &energies2[0], NULL, &gradients2[0]);
+        ASSERT(energies2 == energies);
+        ASSERT(gradients2 == gradients);
+    }
+    bool thrown = false;
+    try {
+        force->computeBatch(&frames[0], 1, numParticles-1, &energies[0]);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testProfiling() {
+    // The profile should count evaluations, cache hits, and energy-only evaluations, but
+    // only while profiling is enabled.
+
+    const int numParticles = 30;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(vector<int>());
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    map<string, double> profile;
+    context.setPositions(positions);
+    context.getState(State::Forces);
+    force->getProfile(context, profile);
+    ASSERT_EQUAL(0.0, profile["evaluations"]);
+    force->setUseProfiling(true);
+    force->updateParametersInContext(context);
+    context.getState(State::Forces);
+    context.getState(State::Forces);
+    context.setPositions(referencePos);
+    context.getState(State::Energy);
+    force->getProfile(context, profile);
+    ASSERT_EQUAL(11, profile.size());
+    ASSERT_EQUAL(1.0, profile["numThreads"]);
+    ASSERT_EQUAL(3.0, profile["evaluations"]);
+    ASSERT_EQUAL(1.0, profile["cacheHits"]);
+    ASSERT_EQUAL(1.0, profile["energyOnly"]);
+    ASSERT(profile["gatherTime"] >= 0.0 && profile["forceTime"] >= 0.0);
+    force->resetProfile(context);
+    force->getProfile(context, profile);
+    ASSERT_EQUAL(0.0, profile["evaluations"]);
+}
+
+void testAutotuning() {
+    // With autotuning, the number of threads is chosen up to the maximum requested.  The
+    // results should be the same for any choice.
+
+    const int numParticles = 3000;
+    System system;
+    vector<Vec3> referencePos(numParticles);
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        positions[i] = referencePos[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos);
+    force->addGroup(vector<int>());
+    force->setNumThreads(4);
+    force->setUseAutotuning(true);
+    system.addForce(force);
+    CompositeRMSDForce* plainForce = new CompositeRMSDForce(referencePos);
+    plainForce->addGroup(vector<int>());
+    plainForce->setForceGroup(1);
+    system.addForce(plainForce);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    map<string, double> profile;
+    force->getProfile(context, profile);
+    int numThreads = profile["numThreads"];
+    ASSERT(numThreads >= 1 && numThreads <= 4);
+    State state1 = context.getState(State::Energy | State::Forces, false, 1<<0);
+    State state2 = context.getState(State::Energy | State::Forces, false, 1<<1);
+    ASSERT(state1.getPotentialEnergy() == state2.getPotentialEnergy());
+    for (int i = 0; i < numParticles; i++)
+        ASSERT(state1.getForces()[i] == state2.getForces()[i]);
+
+    // Disabling autotuning restores the number of threads requested.
+
+    force->setUseAutotuning(false);
+    force->updateParametersInContext(context);
+    force->getProfile(context, profile);
+    ASSERT_EQUAL(4.0, profile["numThreads"]);
+}
+
+void testHessianTimesVector() {
+    // The product of the Hessian with a direction should match the central difference of
+    // the forces along it, with several references, groups, and a nonlinear energy.
+
+    const int numParticles = 30;
+    System system;
+    vector<Vec3> referencePos1(numParticles), referencePos2(numParticles);
+    vector<Vec3> positions(numParticles), direction(numParticles);
+    vector<int> group1, group2;
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; ++i) {
+        system.addParticle(1.0);
+        referencePos1[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*10;
+        referencePos2[i] = referencePos1[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt))*2;
+        positions[i] = referencePos1[i] + Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        direction[i] = Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt)) - Vec3(0.5, 0.5, 0.5);
+        if (i < 8)
+            group1.push_back(i);
+        else if (i%4 != 0)
+            group2.push_back(i);
+    }
+    CompositeRMSDForce* force = new CompositeRMSDForce(referencePos1);
+    force->addReferencePositions(referencePos2);
+    force->setEnergyFunction("rmsd0^2 + 2*rmsd1 + rmsd0*rmsd1");
+    force->addGroup(group1);
+    force->addGroup(group2);
+    system.addForce(force);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    vector<Vec3> product;
+    force->computeHessianTimesVector(context, direction, product);
+    ASSERT_EQUAL(numParticles, product.size());
+    const double delta = 1e-5;
+    vector<Vec3> displaced(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        displaced[i] = positions[i] + direction[i]*delta;
+    context.setPositions(displaced);
+    vector<Vec3> forces1 = context.getState(State::Forces).getForces();
+    for (int i = 0; i < numParticles; i++)
+        displaced[i] = positions[i] - direction[i]*delta;
+    context.setPositions(displaced);
+    vector<Vec3> forces2 = context.getState(State::Forces).getForces();
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC((forces2[i]-forces1[i])/(2*delta), product[i], 1e-5);
+
+    // The direction must have one vector per particle.
+
+    direction.pop_back();
+    bool thrown = false;
+    try {
+        force->computeHessianTimesVector(context, direction, product);
+    }
+    catch (const OpenMMException& e) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
 int main(int argc, char* argv[]) {
     try {
         initializeTests(argc, argv);
         testRMSD();
+        testCollinearRMSD();
+        testMultithreading();
+        testWarmStart();
+        testMultipleGroupsGradient();
+        testMultipleReferences();
+        testGroupRMSDs();
+        testGlobalParameters();
+        testMixedPrecision();
+        testIncrementalUpdates();
+        testGroupRanges();
+        testGroupReferencePositions();
+        testSharedData();
+        testBatch();
+        testProfiling();
+        testAutotuning();
+        testHessianTimesVector();
     }
     catch(const exception& e) {
         cout << "exception: " << e.what() << endl;